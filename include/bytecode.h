@@ -1,6 +1,7 @@
 #pragma once
 
 #include <cstdint>
+#include <cstring>
 #include <iostream>
 #include <set>
 #include <string>
@@ -17,14 +18,28 @@ enum class op_code_t {
     getfield_, // get a field value of an object objectref
     goto_, // goes to another instruction at branchoffset
     goto_if_false_, // if value is false (0), goes to another instruction at branchoffset
+    guard_class_, // if local #operand2 is not of class #operand3, goes to branchoffset
     iadd_, // add two ints
     iaload_, // load an int from an array
+    iaload_nc_, // iaload_ without bounds check, the index is known to be in bounds
     iastore_, // store an int into an array
+    iastore_nc_, // iastore_ without bounds check, the index is known to be in bounds
+    if_false_, // if local #operand2 is false (0), goes to the instruction at branchoffset
+    if_ige_, // if value1 >= value2, goes to another instruction at branchoffset
+    if_ilt_, // if value1 < value2, goes to another instruction at branchoffset
+    if_true_, // if local #operand2 is true (1), goes to the instruction at branchoffset
     ilt_, // less than
     imul_, // multiply two integers
     invoke_, // invoke instance method on object objectref and puts result on the stack
+    invoke_direct_, // invoke_ of method #operand, the only one the call can reach from
+                    // receivers of class #operand3 and its subclasses
     isub_, // subtract two integers
     load_, // load a reference onto the stack from a local variable #index
+    load_getfield_, // superinstruction: load_ operand; getfield_ operand2
+    load_ldc_iadd_, // superinstruction: load_ operand; ldc_ operand2; iadd_
+    load_ldc_isub_, // superinstruction: load_ operand; ldc_ operand2; isub_
+    load_load_, // superinstruction: load_ operand; load_ operand2
+    load_load_if_ige_, // superinstruction: load_ operand; load_ operand2; if_ige_
     ldc_, // push a constant onto the stack
     length_, // array length
     new_, // create new object of type identified by class reference
@@ -35,26 +50,58 @@ enum class op_code_t {
     store_, // store value into variable
 };
 
+// A superinstruction stands for a sequence of instructions, which are kept after it: it
+// executes all of them and skips them, so that branch targets and stack maps are left
+// unchanged. They are only introduced by `fuse_superinstructions`, once the bytecode has
+// been verified and analysed. A load_load_if_ige_ reads its branch target from the
+// if_ige_ kept after it.
 struct instruction_t {
     op_code_t op_code;
+    bool ref; // whether the value pushed by a getfield_ or a call is a reference
     long operand, operand2;
-    std::string as_str()
+    // inline cache of an invoke_, assigned by the interpreter, and until then the static
+    // class of its receiver
+    long operand3;
+    // `ref` shares the padding after the op code, keeping instructions 32 bytes long
+    instruction_t(op_code_t op_code, long operand = 0, long operand2 = 0, long operand3 = 0,
+                  bool ref = false)
+      : op_code(op_code), ref(ref), operand(operand), operand2(operand2), operand3(operand3)
     {
+    }
+    std::string as_str() const
+    {
+        auto operands = [this]() {
+            return std::to_string(operand) + " " + std::to_string(operand2);
+        };
         switch (op_code) {
         case op_code_t::band_: return "band";
         case op_code_t::bneg_: return "bneg";
         case op_code_t::getfield_: return "getfield " + std::to_string(operand);
         case op_code_t::goto_: return "goto " + std::to_string(operand);
         case op_code_t::goto_if_false_: return "goto_if_false " + std::to_string(operand);
+        case op_code_t::guard_class_:
+            return "guard_class " + operands() + " " + std::to_string(operand3);
         case op_code_t::iadd_: return "iadd";
         case op_code_t::iaload_: return "iaload";
+        case op_code_t::iaload_nc_: return "iaload_nc";
         case op_code_t::iastore_: return "iastore";
+        case op_code_t::iastore_nc_: return "iastore_nc";
+        case op_code_t::if_false_: return "if_false " + operands();
+        case op_code_t::if_ige_: return "if_ige " + std::to_string(operand);
+        case op_code_t::if_ilt_: return "if_ilt " + std::to_string(operand);
+        case op_code_t::if_true_: return "if_true " + operands();
         case op_code_t::ilt_: return "ilt";
         case op_code_t::imul_: return "imul";
         case op_code_t::invoke_:
             return "invoke " + std::to_string(operand) + " " + std::to_string(operand2);
+        case op_code_t::invoke_direct_: return "invoke_direct " + operands();
         case op_code_t::isub_: return "isub";
         case op_code_t::load_: return "load " + std::to_string(operand);
+        case op_code_t::load_getfield_: return "load_getfield " + operands();
+        case op_code_t::load_ldc_iadd_: return "load_ldc_iadd " + operands();
+        case op_code_t::load_ldc_isub_: return "load_ldc_isub " + operands();
+        case op_code_t::load_load_: return "load_load " + operands();
+        case op_code_t::load_load_if_ige_: return "load_load_if_ige " + operands();
         case op_code_t::ldc_: return "ldc " + std::to_string(operand);
         case op_code_t::length_: return "length";
         case op_code_t::new_: return "new " + std::to_string(operand);
@@ -66,6 +113,261 @@ struct instruction_t {
         default: std::cerr << "Unknown op code" << std::endl; exit(1);
         }
     }
+    // number of operand stack slots consumed by the instruction
+    long pops() const
+    {
+        switch (op_code) {
+        case op_code_t::band_:
+        case op_code_t::iadd_:
+        case op_code_t::iaload_:
+        case op_code_t::iaload_nc_:
+        case op_code_t::if_ige_:
+        case op_code_t::if_ilt_:
+        case op_code_t::ilt_:
+        case op_code_t::imul_:
+        case op_code_t::isub_:
+        case op_code_t::putfield_: return 2;
+        case op_code_t::iastore_:
+        case op_code_t::iastore_nc_: return 3;
+        case op_code_t::invoke_:
+        case op_code_t::invoke_direct_: return operand2;
+        case op_code_t::bneg_:
+        case op_code_t::getfield_:
+        case op_code_t::goto_if_false_:
+        case op_code_t::length_:
+        case op_code_t::newarray_:
+        case op_code_t::print_:
+        case op_code_t::return_:
+        case op_code_t::store_: return 1;
+        default: return 0;
+        }
+    }
+    // whether `operand` is the target of a branch
+    bool is_branch() const
+    {
+        switch (op_code) {
+        case op_code_t::goto_:
+        case op_code_t::goto_if_false_:
+        case op_code_t::guard_class_:
+        case op_code_t::if_false_:
+        case op_code_t::if_ige_:
+        case op_code_t::if_ilt_:
+        case op_code_t::if_true_: return true;
+        default: return false;
+        }
+    }
+    // whether the instruction calls a method
+    bool is_call() const
+    {
+        return op_code == op_code_t::invoke_ || op_code == op_code_t::invoke_direct_;
+    }
+    // whether the frame can be suspended on the instruction by a collection
+    bool is_safepoint() const
+    {
+        return is_call() || op_code == op_code_t::new_ || op_code == op_code_t::newarray_;
+    }
+    // number of operand stack slots produced by the instruction
+    long pushes() const
+    {
+        switch (op_code) {
+        case op_code_t::goto_:
+        case op_code_t::goto_if_false_:
+        case op_code_t::guard_class_:
+        case op_code_t::iastore_:
+        case op_code_t::iastore_nc_:
+        case op_code_t::if_false_:
+        case op_code_t::if_ige_:
+        case op_code_t::if_ilt_:
+        case op_code_t::if_true_:
+        case op_code_t::load_load_if_ige_:
+        case op_code_t::putfield_:
+        case op_code_t::print_:
+        case op_code_t::return_:
+        case op_code_t::store_: return 0;
+        case op_code_t::load_load_: return 2;
+        default: return 1;
+        }
+    }
+};
+
+// Compact encoding of the stack bytecode, which the stack based engines run,
+// `instruction_t` being the representation of the compiler: an instruction is its op code
+// in one byte, followed by its operands, unaligned, in the order of `operand`, `operand2`
+// and `operand3`, with a size which only depends on the op code:
+//   local, field, class or method index, vtable slot   2 bytes
+//   constant                                           4 bytes, signed
+//   branch target, offset in the code of the method    4 bytes
+//   number of arguments of a call                      1 byte
+//   inline cache of an invoke_, or class of the        4 bytes
+//   receiver of an invoke_direct_
+// A call is 8 bytes long whether it is an invoke_ or an invoke_direct_, so that a return
+// steps its caller over the call without knowing which one it is.
+constexpr size_t encoded_size(op_code_t op_code)
+{
+    switch (op_code) {
+    case op_code_t::getfield_:
+    case op_code_t::load_:
+    case op_code_t::new_:
+    case op_code_t::putfield_:
+    case op_code_t::store_: return 3;
+    case op_code_t::goto_:
+    case op_code_t::goto_if_false_:
+    case op_code_t::if_ige_:
+    case op_code_t::if_ilt_:
+    case op_code_t::ldc_:
+    case op_code_t::load_getfield_:
+    case op_code_t::load_load_:
+    case op_code_t::load_load_if_ige_: return 5;
+    case op_code_t::if_false_:
+    case op_code_t::if_true_:
+    case op_code_t::load_ldc_iadd_:
+    case op_code_t::load_ldc_isub_: return 7;
+    case op_code_t::invoke_:
+    case op_code_t::invoke_direct_: return 8;
+    case op_code_t::guard_class_: return 9;
+    default: return 1;
+    }
+}
+
+template <typename T> inline T read_operand(const uint8_t *p)
+{
+    T value;
+    std::memcpy(&value, p, sizeof(T));
+    return value;
+}
+
+// the operands of the encoded instruction at `ip`
+inline op_code_t op_of(const uint8_t *ip)
+{
+    return static_cast<op_code_t>(*ip);
+}
+// of a load_, store_, getfield_, putfield_, new_ or call, or the first local of a
+// superinstruction
+inline uint16_t index_of(const uint8_t *ip)
+{
+    return read_operand<uint16_t>(ip + 1);
+}
+// of an ldc_
+inline int32_t constant_of(const uint8_t *ip)
+{
+    return read_operand<int32_t>(ip + 1);
+}
+// of a branch
+inline uint32_t target_of(const uint8_t *ip)
+{
+    return read_operand<uint32_t>(ip + 1);
+}
+// of an if_false_, if_true_ or guard_class_
+inline uint16_t local_of(const uint8_t *ip)
+{
+    return read_operand<uint16_t>(ip + 5);
+}
+// of a guard_class_
+inline uint16_t class_of(const uint8_t *ip)
+{
+    return read_operand<uint16_t>(ip + 7);
+}
+// of a call
+inline uint8_t nargs_of(const uint8_t *ip)
+{
+    return ip[3];
+}
+// of an invoke_
+inline uint32_t cache_of(const uint8_t *ip)
+{
+    return read_operand<uint32_t>(ip + 4);
+}
+// the second local or field of a load_getfield_, load_load_ or load_load_if_ige_
+inline uint16_t index2_of(const uint8_t *ip)
+{
+    return read_operand<uint16_t>(ip + 3);
+}
+// the constant of a load_ldc_iadd_ or load_ldc_isub_
+inline int32_t constant2_of(const uint8_t *ip)
+{
+    return read_operand<int32_t>(ip + 3);
+}
+
+// Register based instruction set. Registers are the slots of the frame: `this`, the
+// arguments and the locals come first, followed by one temporary per operand stack
+// depth. Operands a, b and c are registers, unless noted otherwise.
+enum class reg_op_code_t {
+    band_, // a = b & c
+    bneg_, // a = !b
+    getfield_, // a = field #c of object b
+    guard_class_, // if a is not an object of class #b, goes to instruction c
+    iadd_, // a = b + c
+    iaddk_, // a = b + constant c
+    iaload_, // a = array b[c]
+    iaload_nc_, // iaload_ without bounds check
+    iastore_, // array a[b] = c
+    iastore_nc_, // iastore_ without bounds check
+    ilt_, // a = b < c
+    ilt_jf_, // if !(a < b) goes to instruction c
+    ilt_jt_, // if a < b goes to instruction c
+    imul_, // a = b * c
+    invoke_, // invoke method #b of the object in a with c arguments (a..a+c-1), result in a
+    invoke_direct_, // invoke_ of method #b of the program, the only one the call can reach
+    isub_, // a = b - c
+    isubk_, // a = b - constant c
+    jf_, // if a is false (0), goes to instruction b
+    jmp_, // goes to instruction a
+    jt_, // if a is true (1), goes to instruction b
+    ldc_, // a = constant b
+    length_, // a = length of array b
+    mov_, // a = b
+    new_, // a = new object of class #b
+    newarray_, // a = new array of length b
+    print_, // print a
+    putfield_, // field #b of object a = c
+    return_, // return a
+};
+
+struct reg_instruction_t {
+    reg_op_code_t op_code;
+    long a, b, c;
+    long d; // inline cache of an invoke_, assigned by the interpreter
+    std::string as_str() const
+    {
+        auto r = [](long i) { return "r" + std::to_string(i); };
+        auto k = [](long i) { return std::to_string(i); };
+        switch (op_code) {
+        case reg_op_code_t::band_: return "band " + r(a) + ", " + r(b) + ", " + r(c);
+        case reg_op_code_t::bneg_: return "bneg " + r(a) + ", " + r(b);
+        case reg_op_code_t::getfield_: return "getfield " + r(a) + ", " + r(b) + ", " + k(c);
+        case reg_op_code_t::guard_class_:
+            return "guard_class " + r(a) + ", " + k(b) + ", " + k(c);
+        case reg_op_code_t::iadd_: return "iadd " + r(a) + ", " + r(b) + ", " + r(c);
+        case reg_op_code_t::iaddk_: return "iaddk " + r(a) + ", " + r(b) + ", " + k(c);
+        case reg_op_code_t::iaload_: return "iaload " + r(a) + ", " + r(b) + ", " + r(c);
+        case reg_op_code_t::iaload_nc_:
+            return "iaload_nc " + r(a) + ", " + r(b) + ", " + r(c);
+        case reg_op_code_t::iastore_: return "iastore " + r(a) + ", " + r(b) + ", " + r(c);
+        case reg_op_code_t::iastore_nc_:
+            return "iastore_nc " + r(a) + ", " + r(b) + ", " + r(c);
+        case reg_op_code_t::ilt_: return "ilt " + r(a) + ", " + r(b) + ", " + r(c);
+        case reg_op_code_t::ilt_jf_: return "ilt_jf " + r(a) + ", " + r(b) + ", " + k(c);
+        case reg_op_code_t::ilt_jt_: return "ilt_jt " + r(a) + ", " + r(b) + ", " + k(c);
+        case reg_op_code_t::imul_: return "imul " + r(a) + ", " + r(b) + ", " + r(c);
+        case reg_op_code_t::invoke_: return "invoke " + r(a) + ", " + k(b) + ", " + k(c);
+        case reg_op_code_t::invoke_direct_:
+            return "invoke_direct " + r(a) + ", " + k(b) + ", " + k(c);
+        case reg_op_code_t::isub_: return "isub " + r(a) + ", " + r(b) + ", " + r(c);
+        case reg_op_code_t::isubk_: return "isubk " + r(a) + ", " + r(b) + ", " + k(c);
+        case reg_op_code_t::jf_: return "jf " + r(a) + ", " + k(b);
+        case reg_op_code_t::jmp_: return "jmp " + k(a);
+        case reg_op_code_t::jt_: return "jt " + r(a) + ", " + k(b);
+        case reg_op_code_t::ldc_: return "ldc " + r(a) + ", " + k(b);
+        case reg_op_code_t::length_: return "length " + r(a) + ", " + r(b);
+        case reg_op_code_t::mov_: return "mov " + r(a) + ", " + r(b);
+        case reg_op_code_t::new_: return "new " + r(a) + ", " + k(b);
+        case reg_op_code_t::newarray_: return "newarray " + r(a) + ", " + r(b);
+        case reg_op_code_t::print_: return "print " + r(a);
+        case reg_op_code_t::putfield_: return "putfield " + r(a) + ", " + k(b) + ", " + r(c);
+        case reg_op_code_t::return_: return a < 0 ? "return" : "return " + r(a);
+        default: std::cerr << "Unknown op code" << std::endl; exit(1);
+        }
+    }
 };
 
 } // namespace bytecode
@@ -74,12 +376,35 @@ namespace bc_compiler {
 
 struct method_layout_t;
 
+// Type of a value for the verifier: the index of a class for its objects, or one of these
+constexpr long type_int = -1; // ints and booleans
+constexpr long type_array = -2; // int arrays
+constexpr long type_any_ref = -3; // objects or arrays, which can only be stored or passed
+
+// Interval of a class in a preorder numbering of the hierarchy: its subclasses are numbered
+// right after it, up to `last_descendant`
+struct class_interval_t {
+    long preorder = -1;
+    long last_descendant = -1;
+    bool contains(const class_interval_t &c) const
+    {
+        return preorder <= c.preorder && c.preorder <= last_descendant;
+    }
+};
+
 struct class_layout_t {
     std::string parent;
     std::string name;
     std::vector<std::string> fields;
     std::vector<std::pair<std::string, std::string>> vtbl;
-    std::vector<method_layout_t *> vtable;
+    // indices of the fields holding references
+    std::vector<int32_t> ref_fields;
+    // type of each field
+    std::vector<long> field_types;
+    // set by number_classes, once the classes of the program are known
+    class_interval_t interval;
+    // runtime descriptor of the class, in the metadata arena of the interpreter
+    class_info_t *info = nullptr;
 };
 
 enum class bb_state_t {
@@ -116,8 +441,93 @@ struct method_layout_t {
     std::vector<std::string> args;
     std::vector<std::string> locals;
     std::vector<bytecode::instruction_t> instructions;
+    // register based version of `instructions`, see `compile_registers`
+    std::vector<bytecode::reg_instruction_t> reg_instructions;
+    size_t nregs = 0;
+    // maximum depth of the operand stack, see `verify`
+    size_t max_stack = 0;
+    // whether `this`, each argument and each local holds a reference, and its type
+    std::vector<bool> local_refs;
+    std::vector<long> local_types;
+    long return_type = type_int;
+    // reference slots of the frame at each safepoint (an invoke_, new_ or newarray_),
+    // indexed by instruction, see `verify` and `compile_registers`
+    std::vector<std::vector<int32_t>> stack_maps;
+    std::vector<std::vector<int32_t>> reg_stack_maps;
+    // compact encoding of `instructions`, see `encode`, and the offset of each instruction
+    // in it, followed by its size
+    std::vector<uint8_t> code;
+    std::vector<uint32_t> code_offsets;
 };
 
+// the instructions control can flow to after the one at `pc`
+std::vector<size_t> successors(const bytecode::instruction_t &i, size_t pc);
+
+// operand stack depth before each instruction of a method, -1 if unreachable; exits with
+// an error if the stack can underflow or if two paths merge with different depths
+std::vector<long> stack_depths(const method_layout_t &method);
+
+// whether each operand stack slot holds a reference, before each instruction of a method
+// (empty if unreachable); exits with an error if two paths merge with different kinds
+std::vector<std::vector<bool>> stack_refs(const method_layout_t &method);
+
+// check the classes and the types of the stack bytecode of the methods of a program, and
+// compute the `max_stack` and `stack_maps` of each method, see verifier.cpp
+void verify(const std::vector<class_layout_t> &classes,
+            std::vector<method_layout_t> &methods);
+
+// replace the array accesses of a method whose index is proven to be within the bounds of
+// the array by their unchecked variant, see bce.cpp; the method must have been verified
+void eliminate_bounds_checks(method_layout_t &method);
+
+// replace the most frequent sequences of instructions of a method by superinstructions,
+// run by the stack based engines
+void fuse_superinstructions(method_layout_t &method);
+
+// fill the compact encoding of a method, run by the stack based engines, once the inline
+// caches of its invoke_ are assigned; exits with an error if an operand does not fit it
+void encode(method_layout_t &method);
+
+// translate the stack bytecode of a method into register bytecode
+void compile_registers(method_layout_t &method);
+
+struct inline_stats_t {
+    size_t call_sites = 0;
+    size_t inlined = 0; // including the guarded ones
+    size_t guarded = 0; // behind a guard_class_ on the static class of the receiver
+    size_t direct = 0; // calls left turned into invoke_direct_
+};
+
+// number the classes in a preorder walk of their hierarchy into their `interval`, see
+// bc_compiler.cpp; exits with an error if a class inherits from itself
+void number_classes(std::vector<class_layout_t> &classes);
+
+// inline the calls to methods of at most `budget` instructions which call no other
+// method, see inliner.cpp; runs before the methods are verified
+void inline_methods(const std::vector<class_layout_t> &classes,
+                    std::vector<method_layout_t> &methods, size_t budget,
+                    inline_stats_t &stats);
+
+// turn the calls with a single possible target into invoke_direct_, see inliner.cpp
+void devirtualize(const std::vector<class_layout_t> &classes,
+                  std::vector<method_layout_t> &methods, inline_stats_t &stats);
+
+// print the program as a C translation unit running on the GC, see c_backend.cpp
+void emit_c(const std::vector<class_layout_t> &classes,
+            const std::vector<method_layout_t> &methods);
+
+// write the verified program to the file `path` as an image, see image.cpp
+void write_image(const std::string &path, const std::vector<class_layout_t> &classes,
+                 const std::vector<method_layout_t> &methods);
+
+// load the program from the image in the file open as `fd`, which it maps in memory;
+// returns false if the file is not an image, and exits with an error if it is a bad one
+bool load_image(int fd, std::vector<class_layout_t> &classes,
+                std::vector<method_layout_t> &methods);
+
+// print the instructions of each method
+void print(const std::vector<method_layout_t> &methods);
+
 class layout_visitor_t : public visitor::visitor_t {
 public:
     std::vector<class_layout_t> classes;
@@ -202,7 +612,13 @@ public:
       : classes(classes), methods(methods), current_method(0), type_checker(type_checker)
     {
     }
-    void print();
+    // index of the argument or local `name` in the frame, -1 if it is a field
+    long local_index(const std::string &name);
+    // compile `condition` into branches taken when it evaluates to `value`, from the basic
+    // blocks added to `jumps`, whose else branch is left for the caller to set; the
+    // current basic block is then the one reached when it does not
+    void branch_if(parser::expression_t *condition, bool value,
+                   std::vector<basic_block_t *> &jumps);
     void visit(parser::goal_t *node) override;
     void visit(parser::main_class_t *node) override;
     void visit(parser::class_decl_t *node) override;
@@ -0,0 +1,41 @@
+#pragma once
+
+#include <bytecode.h>
+
+// the JIT emits x86-64 code into pages mapped with mmap
+#if defined(__x86_64__) && (defined(__linux__) || defined(__APPLE__))
+#define HAVE_JIT
+#endif
+
+namespace jit {
+
+// Native code of a method, run on the frame of the method, `fp`: starts at `entry`, the
+// native address of one of its instructions, and runs until its return_, which pops the
+// frame and pushes the returned value on the operand stack of the caller as exec_return
+// does. The operand stack stays in the frame, so that the code can be entered and left at
+// any branch target.
+typedef void (*code_t)(void **locals, void *context, void *entry);
+
+// A function of the interpreter called by native code, with the `context` the code was
+// entered with, the encoded instruction `fp` is on and the top of its operand stack
+typedef void (*helper_t)(void *context, uint8_t *ip, void **sp);
+
+struct runtime_t {
+    helper_t exec; // runs an instruction in the interpreter
+    helper_t invoke; // runs the call at `ip`, until the callee has returned
+    const std::vector<bc_compiler::class_layout_t> *classes;
+};
+
+struct compiled_method_t {
+    code_t code = nullptr;
+    // native address of the instructions the code can be entered at, its first one and
+    // the branch targets, by offset in the encoded code of the method, null for the others
+    std::vector<void *> entries;
+};
+
+// compile a verified and encoded method to native code; returns false if it holds
+// superinstructions, which the JIT does not compile
+bool compile(const bc_compiler::method_layout_t &method, const runtime_t &runtime,
+             compiled_method_t &compiled);
+
+} // namespace jit
@@ -8,8 +8,6 @@ extern "C" {
 #include <assert.h>
 #include <stdint.h>
 
-void *managed_alloc(size_t size);
-
 typedef struct {
     union {
         uint8_t tag : 3;
@@ -19,130 +17,246 @@ typedef struct {
     // payload
 } heapval_t;
 
-#define VAL_INT_TAG (1 << 0)
-
-#define MARKED_TAG (1 << 0)
+// set in the vtable word of arrays, which all share a class descriptor without references
 #define VAL_ARRAY_TAG (1 << 1)
-#define VAL_FRAME_TAG (1 << 2)
+// a young object copied out of the nursery has its new address in its vtable field
+#define FORWARDED_TAG (1 << 0)
+#define TAG_MASK ((int64_t)7)
 
 static inline int64_t *pith_field(heapval_t *val, size_t idx)
 {
     return (int64_t *)((uint8_t *)val + sizeof(heapval_t) + idx * sizeof(int64_t));
 }
 
+// the elements of an array follow its header, as the fields of an object
 static inline int64_t *pith_field_arr(heapval_t *val, size_t idx)
 {
-    return (int64_t *)((uint8_t *)val->vtable + idx * sizeof(int64_t));
+    return pith_field(val, idx);
+}
+
+static inline void array_index_out_of_bounds(heapval_t *val, int64_t idx)
+{
+    // the output of the program comes first
+    fflush(stdout);
+    fprintf(stderr, "ArrayIndexOutOfBoundsException: index %ld, length %ld\n", (long)idx,
+            (long)val->size);
+    exit(1);
+}
+
+static inline void negative_array_size(int64_t len)
+{
+    fflush(stdout);
+    fprintf(stderr, "NegativeArraySizeException: length %ld\n", (long)len);
+    exit(1);
 }
 
+// as `pith_field_arr`, exits if `idx` is not an index of the array
+static inline int64_t *pith_field_arr_checked(heapval_t *val, int64_t idx)
+{
+    // a negative index wraps around to a large unsigned one
+    if ((uint64_t)idx >= (uint64_t)val->size) {
+        array_index_out_of_bounds(val, idx);
+    }
+    return pith_field(val, idx);
+}
+
+// Ints are stored untagged in stack slots, fields and arrays: the reference maps of the
+// classes and the stack maps of the methods tell the collector which slots hold
+// references, so a slot is never inspected to find out what it holds.
 static inline int64_t ptr_to_int(void *ptr)
 {
-    int64_t iptr = (int64_t)ptr;
-    assert(iptr & VAL_INT_TAG);
-    return (iptr >> 1);
+    return (int64_t)ptr;
 }
 
 static inline void *int_to_ptr(int64_t i)
 {
-    return (void *)((i << 1) | VAL_INT_TAG);
+    return (void *)i;
 }
 
 static inline heapval_t *ptr_to_hval(void *ptr)
 {
-    assert(!((int64_t)ptr & VAL_INT_TAG));
-    return (heapval_t *)((int64_t)ptr);
+    assert(!((int64_t)ptr & TAG_MASK));
+    return (heapval_t *)ptr;
 }
 
-heapval_t *alloc_heapval(void *vtable, size_t size);
-heapval_t *alloc_arr(size_t size);
+// the vtable of an object, without the GC bits of the header
+static inline void *hval_vtable(heapval_t *val)
+{
+    return (void *)((int64_t)val->vtable & ~TAG_MASK);
+}
+
+// Reference map: the indices of the slots holding references, among the fields of an
+// object or the slots of a frame. The collector only traces these, the other slots hold
+// ints.
+typedef struct {
+    int64_t nrefs;
+    const int32_t *refs;
+} ref_map_t;
 
+// Entry point of a method, resolved for the code which runs it
 typedef struct {
-    void **buffer;
-    size_t size;
-    size_t capacity;
-} vector_t;
+    void *code; // first instruction, or function of the C backend
+    int64_t method; // index of the method in the program
+    int32_t nlocals; // locals, or registers past the arguments for the register engine
+    int32_t max_stack;
+} method_entry_t;
 
-static inline void vector_init(vector_t *vec, size_t capacity)
+// Runtime descriptor of a class, the vtable word of its objects points to it. The vtable
+// follows inline, so that a virtual call loads its target from the descriptor itself.
+typedef struct {
+    ref_map_t ref_map;
+    int64_t id; // index of the class in the program
+    // interval of the class in a preorder numbering of the hierarchy, see class_is_subclass
+    int64_t preorder;
+    int64_t last_descendant;
+    int64_t nfields;
+    int64_t nmethods;
+    method_entry_t methods[];
+} class_info_t;
+
+// whether `c` is `ancestor` or one of its subclasses: the subclasses of a class are
+// numbered right after it
+static inline int class_is_subclass(const class_info_t *c, const class_info_t *ancestor)
 {
-    vec->buffer = (void **)malloc(capacity * sizeof(void *));
-    if (vec->buffer == NULL) {
-        fprintf(stderr, "vector_init: malloc failed\n");
-        exit(1);
-    }
-    vec->size = 0;
-    vec->capacity = capacity;
+    return ancestor->preorder <= c->preorder && c->preorder <= ancestor->last_descendant;
 }
 
-static inline void vector_push(vector_t *vec, void *elem)
+static inline const ref_map_t *hval_ref_map(heapval_t *val)
 {
-    if (vec->size == vec->capacity) {
-        vec->capacity *= 2;
-        vec->buffer = (void **)realloc(vec->buffer, vec->capacity * sizeof(void *));
-        if (vec->buffer == NULL) {
-            fprintf(stderr, "vector_push: realloc failed\n");
-            exit(1);
-        }
-    }
-    vec->buffer[vec->size++] = elem;
+    return &((class_info_t *)hval_vtable(val))->ref_map;
 }
 
-static inline void *vector_pop(vector_t *vec)
+heapval_t *alloc_heapval(void *vtable, size_t size);
+// `len` comes from the program, a negative one exits with a NegativeArraySizeException
+heapval_t *alloc_arr(int64_t len);
+
+// Objects and arrays are allocated in the nursery and promoted to the old space when they
+// survive a minor collection; the ones too large for the nursery are allocated in the old
+// space directly. Arrays only hold ints.
+extern uint8_t *nursery_start;
+extern uint8_t *nursery_end;
+extern uint8_t *heap_start;
+extern uint64_t *remembered_bits;
+
+void heap_init(void);
+
+// index of the 8-byte granule of an old object in the side bitmaps of the heap
+static inline size_t granule_of(void *ptr)
 {
-    if (vec->size == 0) {
-        fprintf(stderr, "vector_pop: empty vector\n");
-        exit(1);
-    }
-    return vec->buffer[--vec->size];
+    return ((uint8_t *)ptr - heap_start) / sizeof(int64_t);
 }
 
-static inline void vector_set(vector_t *vec, size_t idx, void *elem)
+static inline int is_remembered(heapval_t *obj)
 {
-    if (idx >= vec->size) {
-        fprintf(stderr, "vector_set: index out of bounds\n");
-        exit(1);
-    }
-    vec->buffer[idx] = elem;
+    size_t bit = granule_of(obj);
+    return (remembered_bits[bit / 64] >> (bit % 64)) & 1;
 }
 
-static inline void *vector_get(vector_t *vec, size_t idx)
+static inline int is_young(void *ptr)
 {
-    if (idx >= vec->size) {
-        fprintf(stderr, "vector_get: index out of bounds\n");
-        exit(1);
-    }
-    return vec->buffer[idx];
+    return (uint8_t *)ptr >= nursery_start && (uint8_t *)ptr < nursery_end;
 }
 
-static inline void *vector_top(vector_t *vec)
+void remember(heapval_t *obj);
+
+// must be called when `val` is stored into a field of `obj`: old objects pointing to young
+// ones are roots of the next minor collection. An int which happens to look like a young
+// address only remembers `obj` needlessly, its field is not traced.
+static inline void write_barrier(heapval_t *obj, void *val)
 {
-    if (vec->size == 0) {
-        fprintf(stderr, "vector_top: empty vector\n");
-        exit(1);
+    if (is_young(val) && !is_young(obj) && !is_remembered(obj)) {
+        remember(obj);
     }
-    return vec->buffer[vec->size - 1];
 }
 
-static inline void vector_destroy(vector_t *vec)
-{
-    free(vec->buffer);
-    vec->buffer = NULL;
-    vec->size = 0;
-    vec->capacity = 0;
-}
+// number of threads marking the old space
+extern int gc_threads;
+
+typedef struct {
+    size_t count;
+    double total_ms;
+    double max_ms;
+} pause_stats_t;
+
+typedef struct {
+    pause_stats_t minor; // minor collections triggered by a full nursery
+    pause_stats_t major; // full collections, including the minor one they start with
+    size_t promoted_bytes;
+    size_t lazily_swept_pages;
+} gc_stats_t;
 
+extern gc_stats_t gc_stats;
+
+// All frames share a single contiguous VM stack. A frame owns the slots from `locals`
+// (`this`, the arguments and the locals) up to `sp`, its operand stack growing on top of
+// its locals. A callee frame starts where the arguments sit on the operand stack of its
+// caller, so the live part of the VM stack is always [vm_stack, fp->sp).
 typedef struct {
-    vector_t val_stack;
-    vector_t locals;
+    void **locals;
+    void **sp;
     void *ip_start;
     void *ip;
 } frame_t;
 
-frame_t *frame_create(void);
-void frame_destroy(frame_t *frame);
-
-extern vector_t frames;
+extern void **vm_stack;
+extern void **vm_stack_limit;
+// frames[0] is a sentinel below the frame of `main`
+extern frame_t *frames;
+extern frame_t *frames_limit;
 extern frame_t *fp;
 
+void vm_stack_init(void);
+
+// Register the stack maps of a method, whose frames are walked by the collector: `maps`
+// holds one reference map per instruction of `code`, `insn_size` bytes apart, and only
+// needs to be filled for the safepoints, the instructions a frame can be suspended on
+// during a collection: a call, or an allocation for the innermost frame. The slots of
+// the map are relative to the `locals` of the frame. Code of variable length instructions
+// has one map per byte, `insn_size` being 1, filled at the offsets of its safepoints.
+void register_stack_maps(void *code, size_t insn_size, const ref_map_t *maps);
+
+static inline void vm_stack_overflow(void)
+{
+    fprintf(stderr, "Stack overflow\n");
+    exit(1);
+}
+
+// push a frame whose `nargs` arguments are already stored at `locals`, followed by
+// `nlocals` locals initialized to NULL and an operand stack of at most `max_stack` slots
+static inline frame_t *frame_push(void **locals, size_t nargs, size_t nlocals,
+                                  size_t max_stack)
+{
+    frame_t *frame = fp + 1;
+    void **sp = locals + nargs + nlocals;
+    if (frame == frames_limit || sp + max_stack > vm_stack_limit) {
+        vm_stack_overflow();
+    }
+    for (void **p = locals + nargs; p < sp; p++) {
+        *p = NULL;
+    }
+    frame->locals = locals;
+    frame->sp = sp;
+    fp = frame;
+    return frame;
+}
+
+static inline void frame_pop(void)
+{
+    fp--;
+}
+
+// unchecked, `frame_push` made room for the maximum depth of the operand stack
+static inline void stack_push(frame_t *frame, void *val)
+{
+    assert(frame->sp < vm_stack_limit);
+    *frame->sp++ = val;
+}
+
+static inline void *stack_pop(frame_t *frame)
+{
+    return *--frame->sp;
+}
+
 #ifdef __cplusplus
 } // extern "C"
 #endif
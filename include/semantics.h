@@ -43,6 +43,9 @@ struct class_symtbl_t : public type_t {
     std::string name;
     std::map<std::string, type_t *> fields;
     std::vector<method_symtbl_t *> methods;
+    // interval of the class in the numbering of the hierarchy, see symtbl_t::number_classes
+    size_t preorder = 0;
+    size_t last_descendant = 0;
     std::string as_str() override { return name; }
     bool is_subtype(class_symtbl_t *other);
 };
@@ -50,6 +53,7 @@ struct class_symtbl_t : public type_t {
 struct symtbl_t {
     std::map<std::string, class_symtbl_t *> classes;
     type_t *str_to_type(const std::string &name);
+    void number_classes();
     void print();
 };
 
@@ -0,0 +1,101 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+// Chase-Lev work-stealing deque ("Dynamic Circular Work-Stealing Deque", with the memory
+// orders of Le et al., "Correct and Efficient Work-Stealing for Weak Memory Models").
+// The owner pushes and pops at the bottom, thieves steal from the top. `T` must be a
+// pointer type, nullptr is returned when the deque is empty or a steal lost a race.
+template <typename T> class ws_deque_t {
+    struct array_t {
+        int64_t size;
+        std::unique_ptr<std::atomic<T>[]> buffer;
+        explicit array_t(int64_t size) : size(size), buffer(new std::atomic<T>[size]) {}
+        T get(int64_t i) { return buffer[i & (size - 1)].load(std::memory_order_relaxed); }
+        void put(int64_t i, T x) { buffer[i & (size - 1)].store(x, std::memory_order_relaxed); }
+    };
+    std::atomic<int64_t> top{0};
+    std::atomic<int64_t> bottom{0};
+    std::atomic<array_t *> array;
+    // grown arrays may still be read by thieves, they are freed with the deque
+    std::vector<std::unique_ptr<array_t>> arrays;
+
+public:
+    explicit ws_deque_t(int64_t size = 1024)
+    {
+        arrays.emplace_back(new array_t(size));
+        array.store(arrays.back().get(), std::memory_order_relaxed);
+    }
+    ws_deque_t(const ws_deque_t &) = delete;
+    ws_deque_t &operator=(const ws_deque_t &) = delete;
+
+    bool empty() const
+    {
+        return bottom.load(std::memory_order_relaxed) <= top.load(std::memory_order_relaxed);
+    }
+
+    // owner only
+    void push(T x)
+    {
+        auto b = bottom.load(std::memory_order_relaxed);
+        auto t = top.load(std::memory_order_acquire);
+        auto a = array.load(std::memory_order_relaxed);
+        if (b - t > a->size - 1) {
+            auto grown = new array_t(a->size * 2);
+            for (auto i = t; i < b; i++) {
+                grown->put(i, a->get(i));
+            }
+            arrays.emplace_back(grown);
+            array.store(grown, std::memory_order_release);
+            a = grown;
+        }
+        a->put(b, x);
+        std::atomic_thread_fence(std::memory_order_release);
+        bottom.store(b + 1, std::memory_order_relaxed);
+    }
+
+    // owner only
+    T pop()
+    {
+        auto b = bottom.load(std::memory_order_relaxed) - 1;
+        auto a = array.load(std::memory_order_relaxed);
+        bottom.store(b, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        auto t = top.load(std::memory_order_relaxed);
+        if (t > b) {
+            bottom.store(b + 1, std::memory_order_relaxed);
+            return nullptr;
+        }
+        auto x = a->get(b);
+        if (t == b) {
+            // last element, race against the thieves
+            if (!top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst,
+                                             std::memory_order_relaxed)) {
+                x = nullptr;
+            }
+            bottom.store(b + 1, std::memory_order_relaxed);
+        }
+        return x;
+    }
+
+    // any thread
+    T steal()
+    {
+        auto t = top.load(std::memory_order_acquire);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        auto b = bottom.load(std::memory_order_acquire);
+        if (t >= b) {
+            return nullptr;
+        }
+        auto a = array.load(std::memory_order_acquire);
+        auto x = a->get(t);
+        if (!top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst,
+                                         std::memory_order_relaxed)) {
+            return nullptr;
+        }
+        return x;
+    }
+};
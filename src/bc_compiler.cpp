@@ -1,4 +1,5 @@
 #include <iostream>
+#include <unordered_map>
 
 #include <bytecode.h>
 
@@ -11,6 +12,27 @@ namespace bc_compiler {
 size_t basic_block_t::bb_num = 0;
 size_t basic_block_t::bb_inst_num = 0;
 
+// whether the values of a type are references to the heap (objects and arrays)
+static bool is_ref_type(semantics::type_t *type)
+{
+    return type != semantics::integer_type && type != semantics::boolean_type;
+}
+
+// the type of the verifier for a type of the type checker
+static long type_index(const std::vector<class_layout_t> &classes, semantics::type_t *type)
+{
+    if (!is_ref_type(type)) {
+        return type_int;
+    }
+    if (type == semantics::array_type) {
+        return type_array;
+    }
+    auto name = type->as_str();
+    auto c = std::find_if(classes.begin(), classes.end(),
+                          [&name](const class_layout_t &cl) { return cl.name == name; });
+    return std::distance(classes.begin(), c);
+}
+
 void basic_block_t::compute_jmp_targets_(size_t n, std::set<basic_block_t *> &visited)
 {
     if (visited.find(this) != visited.end()) {
@@ -55,7 +77,7 @@ void basic_block_t::fix_goto_(size_t n, std::set<basic_block_t *> &visited)
         if (i.op_code == bytecode::op_code_t::goto_) {
             i.operand = then_branch->bb_inst_start;
         }
-        if (i.op_code == bytecode::op_code_t::goto_if_false_) {
+        else if (i.is_branch()) {
             i.operand = else_branch->bb_inst_start;
         }
     }
@@ -105,6 +127,53 @@ void basic_block_t::try_linearize(std::vector<bytecode::instruction_t> &vi, size
     try_linearize_(vi, n, visited);
 }
 
+static void number_subtree(long c, const std::vector<std::vector<long>> &subclasses,
+                           std::vector<class_layout_t> &classes, long &next)
+{
+    auto &interval = classes[c].interval;
+    interval.preorder = next++;
+    for (auto subclass : subclasses[c]) {
+        number_subtree(subclass, subclasses, classes, next);
+    }
+    interval.last_descendant = next - 1;
+}
+
+// A class is a subclass of another, itself included, when its number falls within the
+// interval of the other, which takes constant time whatever the depth of the hierarchy.
+// Classes whose parent is not found are roots, as the main class.
+void number_classes(std::vector<class_layout_t> &classes)
+{
+    std::unordered_map<std::string, long> index;
+    for (size_t c = 0; c < classes.size(); ++c) {
+        index.emplace(classes[c].name, c);
+    }
+    std::vector<std::vector<long>> subclasses(classes.size());
+    std::vector<long> roots;
+    for (size_t c = 0; c < classes.size(); ++c) {
+        auto parent = index.find(classes[c].parent);
+        if (parent == index.end()) {
+            roots.push_back(c);
+        }
+        else {
+            subclasses[parent->second].push_back(c);
+        }
+    }
+    for (auto &c : classes) {
+        c.interval = class_interval_t{};
+    }
+    long next = 0;
+    for (auto root : roots) {
+        number_subtree(root, subclasses, classes, next);
+    }
+    for (size_t c = 0; c < classes.size(); ++c) {
+        if (classes[c].interval.preorder == -1) {
+            std::cerr << "error: class " << classes[c].name << " inherits from itself"
+                      << std::endl;
+            exit(1);
+        }
+    }
+}
+
 void layout_visitor_t::visit(parser::goal_t *node)
 {
     node->main_class->accept(this);
@@ -143,12 +212,17 @@ void layout_visitor_t::visit(parser::class_decl_t *node)
         parent_class_name = it->parent;
     }
     std::reverse(parent_class_hierarchy.begin(), parent_class_hierarchy.end());
-    classes.push_back(class_layout_t{parent_class_name, current_class, {}});
+    std::string parent;
+    if (!parent_class_hierarchy.empty()) {
+        parent = parent_class_hierarchy.back();
+    }
+    classes.push_back(class_layout_t{parent, current_class, {}});
     auto &current_class_layout = classes.back();
-    // add the fields of the parent classes
-    for (auto &c : parent_class_hierarchy) {
-        auto it = std::find_if(classes.begin(), classes.end(),
-                               [&c](const class_layout_t &cl) { return cl.name == c; });
+    // add the fields of the parent class, which start with those of its own parents
+    if (!parent.empty()) {
+        auto it =
+            std::find_if(classes.begin(), classes.end(),
+                         [&parent](const class_layout_t &cl) { return cl.name == parent; });
         current_class_layout.fields.insert(current_class_layout.fields.end(),
                                            it->fields.begin(), it->fields.end());
     }
@@ -259,6 +333,9 @@ void bc_compiler_visitor_t::visit(parser::goal_t *node)
 
 void bc_compiler_visitor_t::visit(parser::main_class_t *node)
 {
+    // `main` has no `this`, its slot stays empty
+    methods.at(current_method).local_refs = {false};
+    methods.at(current_method).local_types = {type_int};
     node->statement->accept(this);
     // put a return instruction at the end of the main method
     current_basic_block->instructions.push_back(
@@ -268,6 +345,31 @@ void bc_compiler_visitor_t::visit(parser::main_class_t *node)
 
 void bc_compiler_visitor_t::visit(parser::class_decl_t *node)
 {
+    auto &class_name = node->class_name->name;
+    auto class_layout = std::find_if(classes.begin(), classes.end(),
+                                     [&class_name](const class_layout_t &cl) {
+                                         return cl.name == class_name;
+                                     });
+    // the fields of the parent classes come first, and the parent is declared before
+    size_t nfields = 0;
+    if (node->parent_class_name != nullptr) {
+        auto &parent_name = node->parent_class_name->name;
+        auto parent = std::find_if(classes.begin(), classes.end(),
+                                   [&parent_name](const class_layout_t &cl) {
+                                       return cl.name == parent_name;
+                                   });
+        class_layout->ref_fields = parent->ref_fields;
+        class_layout->field_types = parent->field_types;
+        nfields = parent->fields.size();
+    }
+    for (auto &field_decl : node->field_decls) {
+        auto type = type_checker.symtbl->str_to_type(field_decl->type->type_name->name);
+        if (is_ref_type(type)) {
+            class_layout->ref_fields.push_back(nfields);
+        }
+        class_layout->field_types.push_back(type_index(classes, type));
+        nfields++;
+    }
     for (auto &method_decl : node->method_decls) {
         method_decl->accept(this);
         current_method++;
@@ -283,12 +385,26 @@ void bc_compiler_visitor_t::visit(parser::method_decl_t *node)
 {
     auto &current_method_layout = methods.at(current_method);
     auto bb = current_basic_block = new basic_block_t;
+    auto symtbl = type_checker.symtbl;
+    current_method_layout.local_refs.push_back(true);
+    current_method_layout.local_types.push_back(
+        type_index(classes, symtbl->classes.at(current_method_layout.method_name.first)));
     for (auto &arg : node->arg_names) {
         current_method_layout.args.push_back(arg->name);
     }
+    for (auto &arg_type : node->arg_types) {
+        auto type = symtbl->str_to_type(arg_type->type_name->name);
+        current_method_layout.local_refs.push_back(is_ref_type(type));
+        current_method_layout.local_types.push_back(type_index(classes, type));
+    }
     for (auto &var_decl : node->var_decls) {
         current_method_layout.locals.push_back(var_decl->var_name->name);
+        auto type = symtbl->str_to_type(var_decl->type->type_name->name);
+        current_method_layout.local_refs.push_back(is_ref_type(type));
+        current_method_layout.local_types.push_back(type_index(classes, type));
     }
+    current_method_layout.return_type =
+        type_index(classes, symtbl->str_to_type(node->return_type->type_name->name));
     for (auto &statement : node->statements) {
         statement->accept(this);
     }
@@ -327,13 +443,85 @@ void bc_compiler_visitor_t::visit(parser::block_statement_t *node)
     }
 }
 
+long bc_compiler_visitor_t::local_index(const std::string &name)
+{
+    auto &current_method_layout = methods.at(current_method);
+    auto &args = current_method_layout.args;
+    auto &locals = current_method_layout.locals;
+    auto it = std::find(args.begin(), args.end(), name);
+    if (it != args.end()) {
+        return std::distance(args.begin(), it) + 1; // +1 because of the this pointer
+    }
+    it = std::find(locals.begin(), locals.end(), name);
+    if (it != locals.end()) {
+        return std::distance(locals.begin(), it) + args.size() + 1;
+    }
+    return -1;
+}
+
+// A comparison or a boolean local, possibly negated, branches on its operands directly
+// instead of pushing a boolean for goto_if_false_ to pop: `i < n` compiles to
+// `load i; load n; if_ige`, and `!done` to `if_true done`. The right operand of `&&` is
+// only evaluated when the left one is true.
+void bc_compiler_visitor_t::branch_if(parser::expression_t *condition, bool value,
+                                      std::vector<basic_block_t *> &jumps)
+{
+    using bytecode::op_code_t;
+    if (auto p = dynamic_cast<parser::parentheses_expression_t *>(condition)) {
+        branch_if(p->expression.get(), value, jumps);
+        return;
+    }
+    if (auto n = dynamic_cast<parser::not_expression_t *>(condition)) {
+        branch_if(n->expression.get(), !value, jumps);
+        return;
+    }
+    auto binary = dynamic_cast<parser::binary_expression_t *>(condition);
+    if (binary != nullptr && binary->op == parser::binary_operator_t::and_) {
+        if (!value) {
+            branch_if(binary->left.get(), false, jumps);
+            branch_if(binary->right.get(), false, jumps);
+            return;
+        }
+        // the conjunction is not true when the left operand is false
+        std::vector<basic_block_t *> skips;
+        branch_if(binary->left.get(), false, skips);
+        branch_if(binary->right.get(), true, jumps);
+        for (auto bb : skips) {
+            bb->else_branch = current_basic_block;
+        }
+        return;
+    }
+    auto identifier = dynamic_cast<parser::identifier_expression_t *>(condition);
+    auto local = identifier != nullptr ? local_index(identifier->identifier->name) : -1;
+    if (binary != nullptr && binary->op == parser::binary_operator_t::less_) {
+        binary->left->accept(this);
+        binary->right->accept(this);
+        auto op_code = value ? op_code_t::if_ilt_ : op_code_t::if_ige_;
+        current_basic_block->instructions.push_back(bytecode::instruction_t{op_code, 0});
+    }
+    else if (local != -1) {
+        auto op_code = value ? op_code_t::if_true_ : op_code_t::if_false_;
+        current_basic_block->instructions.push_back(
+            bytecode::instruction_t{op_code, 0, local});
+    }
+    else {
+        condition->accept(this);
+        if (value) {
+            current_basic_block->instructions.push_back(
+                bytecode::instruction_t{op_code_t::bneg_, 0});
+        }
+        current_basic_block->instructions.push_back(
+            bytecode::instruction_t{op_code_t::goto_if_false_, 0});
+    }
+    jumps.push_back(current_basic_block);
+    current_basic_block->then_branch = new basic_block_t;
+    current_basic_block = current_basic_block->then_branch;
+}
+
 void bc_compiler_visitor_t::visit(parser::if_statement_t *node)
 {
-    node->condition->accept(this);
-    current_basic_block->instructions.push_back(
-        bytecode::instruction_t{bytecode::op_code_t::goto_if_false_, 0});
-    auto bb_cond = current_basic_block;
-    auto bb_then_start = current_basic_block = new basic_block_t;
+    std::vector<basic_block_t *> bb_conds;
+    branch_if(node->condition.get(), false, bb_conds);
     node->then_statement->accept(this);
     current_basic_block->instructions.push_back(
         bytecode::instruction_t{bytecode::op_code_t::goto_, 0});
@@ -341,8 +529,9 @@ void bc_compiler_visitor_t::visit(parser::if_statement_t *node)
     auto bb_else_start = current_basic_block = new basic_block_t;
     node->else_statement->accept(this);
     auto bb_else_end = current_basic_block;
-    bb_cond->then_branch = bb_then_start;
-    bb_cond->else_branch = bb_else_start;
+    for (auto bb_cond : bb_conds) {
+        bb_cond->else_branch = bb_else_start;
+    }
     current_basic_block = new basic_block_t;
     bb_then_end->then_branch = current_basic_block;
     bb_else_end->then_branch = current_basic_block;
@@ -351,21 +540,19 @@ void bc_compiler_visitor_t::visit(parser::if_statement_t *node)
 void bc_compiler_visitor_t::visit(parser::while_statement_t *node)
 {
     auto bb_start = current_basic_block;
-    current_basic_block = new basic_block_t;
-    node->condition->accept(this);
-    current_basic_block->instructions.push_back(
-        bytecode::instruction_t{bytecode::op_code_t::goto_if_false_, 0});
-    auto bb_cond = current_basic_block;
-    auto bb_statement_start = current_basic_block = new basic_block_t;
+    auto bb_cond = current_basic_block = new basic_block_t;
+    std::vector<basic_block_t *> bb_exits;
+    branch_if(node->condition.get(), false, bb_exits);
     node->statement->accept(this);
     current_basic_block->instructions.push_back(
         bytecode::instruction_t{bytecode::op_code_t::goto_, 0});
     auto bb_statement_end = current_basic_block;
     current_basic_block = new basic_block_t;
     bb_start->then_branch = bb_cond;
-    bb_cond->then_branch = bb_statement_start;
     bb_statement_end->then_branch = bb_cond;
-    bb_cond->else_branch = current_basic_block;
+    for (auto bb_exit : bb_exits) {
+        bb_exit->else_branch = current_basic_block;
+    }
 }
 
 void bc_compiler_visitor_t::visit(parser::print_statement_t *node)
@@ -437,7 +624,9 @@ void bc_compiler_visitor_t::visit(parser::array_assign_statement_t *node)
         auto idx = std::distance(current_method_layout.args.begin(), it) +
                    1; // +1 because the first argument is the this pointer
         current_basic_block->instructions.push_back(
-            bytecode::instruction_t{bytecode::op_code_t::iastore_, static_cast<long>(idx)});
+            bytecode::instruction_t{bytecode::op_code_t::load_, static_cast<long>(idx)});
+        current_basic_block->instructions.push_back(
+            bytecode::instruction_t{bytecode::op_code_t::iastore_, 0});
         return;
     }
     // try to find the variable in the local variables
@@ -449,7 +638,9 @@ void bc_compiler_visitor_t::visit(parser::array_assign_statement_t *node)
                    current_method_layout.args.size() +
                    1; // +1 because the first argument is the this pointer
         current_basic_block->instructions.push_back(
-            bytecode::instruction_t{bytecode::op_code_t::iastore_, static_cast<long>(idx)});
+            bytecode::instruction_t{bytecode::op_code_t::load_, static_cast<long>(idx)});
+        current_basic_block->instructions.push_back(
+            bytecode::instruction_t{bytecode::op_code_t::iastore_, 0});
         return;
     }
     // try to find the variable in the fields
@@ -465,7 +656,7 @@ void bc_compiler_visitor_t::visit(parser::array_assign_statement_t *node)
         current_basic_block->instructions.push_back(
             bytecode::instruction_t{bytecode::op_code_t::load_, 0}); // load this pointer
         current_basic_block->instructions.push_back(
-            bytecode::instruction_t{bytecode::op_code_t::getfield_, idx});
+            bytecode::instruction_t{bytecode::op_code_t::getfield_, idx, 0, 0, true});
         current_basic_block->instructions.push_back(
             bytecode::instruction_t{bytecode::op_code_t::iastore_, 0});
         return;
@@ -481,6 +672,26 @@ void bc_compiler_visitor_t::visit(parser::expression_t *node)
 
 void bc_compiler_visitor_t::visit(parser::binary_expression_t *node)
 {
+    if (node->op == parser::binary_operator_t::and_) {
+        // ldc 1 if both operands are true, ldc 0 as soon as one is false
+        std::vector<basic_block_t *> bb_conds;
+        branch_if(node, false, bb_conds);
+        current_basic_block->instructions.push_back(
+            bytecode::instruction_t{bytecode::op_code_t::ldc_, 1});
+        current_basic_block->instructions.push_back(
+            bytecode::instruction_t{bytecode::op_code_t::goto_, 0});
+        auto bb_true = current_basic_block;
+        auto bb_false = current_basic_block = new basic_block_t;
+        current_basic_block->instructions.push_back(
+            bytecode::instruction_t{bytecode::op_code_t::ldc_, 0});
+        for (auto bb_cond : bb_conds) {
+            bb_cond->else_branch = bb_false;
+        }
+        current_basic_block = new basic_block_t;
+        bb_true->then_branch = current_basic_block;
+        bb_false->then_branch = current_basic_block;
+        return;
+    }
     node->left->accept(this);
     node->right->accept(this);
     switch (node->op) {
@@ -500,10 +711,7 @@ void bc_compiler_visitor_t::visit(parser::binary_expression_t *node)
         current_basic_block->instructions.push_back(
             bytecode::instruction_t{bytecode::op_code_t::ilt_, 0});
         break;
-    case parser::binary_operator_t::and_:
-        current_basic_block->instructions.push_back(
-            bytecode::instruction_t{bytecode::op_code_t::band_, 0});
-        break;
+    default: break;
     }
 }
 
@@ -531,6 +739,7 @@ void bc_compiler_visitor_t::visit(parser::method_call_expression_t *node)
     long nargs = node->arg_expressions.size() +
                  1; // +1 because the first argument is the this pointer
     long m_id = -1;
+    bool ref = false;
     auto class_name = methods.at(current_method).method_name.first;
     auto current_method_name = methods.at(current_method).method_name.second;
     auto method_to_call = node->method_name->name;
@@ -565,6 +774,14 @@ void bc_compiler_visitor_t::visit(parser::method_call_expression_t *node)
             });
         if (it != class_layout->vtbl.end()) {
             m_id = std::distance(class_layout->vtbl.begin(), it);
+            // overriding methods keep the return type of the method they override, as
+            // checked by semantic_vis_type_check_t
+            auto &ms = type_checker.symtbl->classes.at(it->first)->methods;
+            auto m = std::find_if(ms.begin(), ms.end(),
+                                  [&method_to_call](const semantics::method_symtbl_t *m) {
+                                      return m->name == method_to_call;
+                                  });
+            ref = m != ms.end() && is_ref_type((*m)->return_type);
         }
     }
     if (m_id == -1) {
@@ -572,8 +789,9 @@ void bc_compiler_visitor_t::visit(parser::method_call_expression_t *node)
                   << std::endl;
         exit(1);
     }
-    current_basic_block->instructions.push_back(
-        bytecode::instruction_t{bytecode::op_code_t::invoke_, m_id, nargs});
+    long receiver_class = std::distance(classes.begin(), class_layout);
+    current_basic_block->instructions.push_back(bytecode::instruction_t{
+        bytecode::op_code_t::invoke_, m_id, nargs, receiver_class, ref});
 }
 
 void bc_compiler_visitor_t::visit(parser::integer_literal_expression_t *node)
@@ -631,10 +849,12 @@ void bc_compiler_visitor_t::visit(parser::identifier_expression_t *node)
         [&node](const std::string &field) { return field == node->identifier->name; });
     if (it2 != current_class_layout->fields.end()) {
         auto idx = std::distance(current_class_layout->fields.begin(), it2);
+        auto &ref_fields = current_class_layout->ref_fields;
+        bool ref = std::find(ref_fields.begin(), ref_fields.end(), idx) != ref_fields.end();
         current_basic_block->instructions.push_back(
             bytecode::instruction_t{bytecode::op_code_t::load_, 0}); // load this pointer
         current_basic_block->instructions.push_back(
-            bytecode::instruction_t{bytecode::op_code_t::getfield_, idx});
+            bytecode::instruction_t{bytecode::op_code_t::getfield_, idx, 0, 0, ref});
         return;
     }
 }
@@ -676,7 +896,66 @@ void bc_compiler_visitor_t::visit(parser::parentheses_expression_t *node)
     node->expression->accept(this);
 }
 
-void bc_compiler_visitor_t::print()
+void fuse_superinstructions(method_layout_t &method)
+{
+    using bytecode::op_code_t;
+    struct superinstruction_t {
+        op_code_t op_code;
+        std::vector<op_code_t> sequence;
+    };
+    // the most frequent sequences in the profiles of the test programs
+    static const std::vector<superinstruction_t> superinstructions = {
+        {op_code_t::load_ldc_iadd_, {op_code_t::load_, op_code_t::ldc_, op_code_t::iadd_}},
+        {op_code_t::load_ldc_isub_, {op_code_t::load_, op_code_t::ldc_, op_code_t::isub_}},
+        {op_code_t::load_load_if_ige_,
+         {op_code_t::load_, op_code_t::load_, op_code_t::if_ige_}},
+        {op_code_t::load_getfield_, {op_code_t::load_, op_code_t::getfield_}},
+        {op_code_t::load_load_, {op_code_t::load_, op_code_t::load_}},
+    };
+    auto &instructions = method.instructions;
+    auto n = instructions.size();
+    auto matches = [&instructions, n](size_t pc, const superinstruction_t &super) {
+        auto &sequence = super.sequence;
+        return pc + sequence.size() <= n &&
+               std::equal(sequence.begin(), sequence.end(), instructions.begin() + pc,
+                          [](op_code_t op_code, const bytecode::instruction_t &i) {
+                              return i.op_code == op_code;
+                          });
+    };
+    // Pick the superinstructions minimizing the number of dispatches of a run through the
+    // method: dispatches[pc] is the minimum from pc on, with the superinstruction chosen
+    // at pc, if any, in choice[pc]
+    std::vector<size_t> dispatches(n + 1, 0);
+    std::vector<const superinstruction_t *> choice(n, nullptr);
+    for (size_t pc = n; pc-- > 0;) {
+        dispatches[pc] = 1 + dispatches[pc + 1];
+        for (auto &super : superinstructions) {
+            if (!matches(pc, super)) {
+                continue;
+            }
+            auto d = 1 + dispatches[pc + super.sequence.size()];
+            if (d < dispatches[pc]) {
+                dispatches[pc] = d;
+                choice[pc] = &super;
+            }
+        }
+    }
+    for (size_t pc = 0; pc < n;) {
+        auto super = choice[pc];
+        if (super == nullptr) {
+            pc++;
+            continue;
+        }
+        // the operand of the second instruction is the one of the sequence, if any,
+        // besides the local of the first load
+        auto &first = instructions[pc];
+        first.operand2 = instructions[pc + 1].operand;
+        first.op_code = super->op_code;
+        pc += super->sequence.size();
+    }
+}
+
+void print(const std::vector<method_layout_t> &methods)
 {
     for (auto &method : methods) {
         std::cout << "method " << method.method_name.first << "."
@@ -687,9 +966,19 @@ void bc_compiler_visitor_t::print()
         for (auto &local : method.locals) {
             std::cout << "  local " << local << std::endl;
         }
+        std::cout << "  max stack " << method.max_stack << std::endl;
         for (auto &instruction : method.instructions) {
             std::cout << "        " << instruction.as_str() << std::endl;
         }
+        if (!method.reg_instructions.empty()) {
+            std::cout << "  registers " << method.nregs << std::endl;
+            for (auto &instruction : method.reg_instructions) {
+                std::cout << "        " << instruction.as_str() << std::endl;
+            }
+            std::cout << "  ; " << method.instructions.size() << " stack instructions, "
+                      << method.reg_instructions.size() << " register instructions"
+                      << std::endl;
+        }
         std::cout << std::endl;
     }
 }
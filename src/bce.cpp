@@ -0,0 +1,359 @@
+#include <algorithm>
+#include <climits>
+#include <set>
+
+#include <bytecode.h>
+
+// ============================================================================
+// Bounds check elimination
+// ============================================================================
+
+namespace bc_compiler {
+
+using bytecode::op_code_t;
+
+// An array is named by the local holding it, or by the field of `this` holding it, encoded
+// as -1 - field index. The length of an array never changes, so what is known about it
+// holds until the local or the field is assigned, or local 0 holding `this`.
+static long field_array(long field)
+{
+    return -1 - field;
+}
+
+static const long no_array = LONG_MIN;
+
+// What is known about an operand stack entry
+enum class value_kind_t {
+    unknown_,
+    constant_, // the constant `a`
+    local_, // the current value of local `a`
+    array_, // the array `b`
+    length_, // the length of the array `b`
+    sum_, // the current value of local `a` plus the constant `b`
+    condition_, // true only if each local of `bounds` is below the length of its array
+};
+
+struct value_t {
+    value_kind_t kind = value_kind_t::unknown_;
+    long a = 0, b = 0;
+    std::vector<std::pair<long, long>> bounds; // (local, array)
+    bool operator==(const value_t &other) const
+    {
+        return kind == other.kind && a == other.a && b == other.b && bounds == other.bounds;
+    }
+};
+
+// What is known before an instruction, the facts about the locals hold for their current
+// value
+struct bounds_state_t {
+    bool reached = false;
+    std::vector<value_t> stack;
+    std::vector<bool> non_negative;
+    std::vector<long> length_of; // array whose length the local holds, or no_array
+    std::vector<std::set<long>> below_length; // arrays whose length the local is below
+};
+
+static long array_of(const value_t &v)
+{
+    switch (v.kind) {
+    case value_kind_t::local_: return v.a;
+    case value_kind_t::array_: return v.b;
+    default: return no_array;
+    }
+}
+
+// drop what is known about the current value of `local` and about the arrays `forget_array`
+// returns true for
+template <typename F> static void forget(bounds_state_t &s, long local, F forget_array)
+{
+    for (auto &v : s.stack) {
+        switch (v.kind) {
+        case value_kind_t::local_:
+        case value_kind_t::sum_:
+            if (v.a == local) {
+                v = value_t{};
+            }
+            break;
+        case value_kind_t::array_:
+        case value_kind_t::length_:
+            if (forget_array(v.b)) {
+                v = value_t{};
+            }
+            break;
+        case value_kind_t::condition_: {
+            auto &b = v.bounds;
+            auto forgotten = [&](const std::pair<long, long> &bound) {
+                return bound.first == local || forget_array(bound.second);
+            };
+            b.erase(std::remove_if(b.begin(), b.end(), forgotten), b.end());
+            if (b.empty()) {
+                v = value_t{};
+            }
+            break;
+        }
+        default: break;
+        }
+    }
+    for (size_t x = 0; x < s.below_length.size(); ++x) {
+        auto &arrays = s.below_length[x];
+        for (auto it = arrays.begin(); it != arrays.end();) {
+            it = forget_array(*it) ? arrays.erase(it) : std::next(it);
+        }
+        if (s.length_of[x] != no_array && forget_array(s.length_of[x])) {
+            s.length_of[x] = no_array;
+        }
+    }
+}
+
+// local x = v
+static void assign(bounds_state_t &s, long x, const value_t &v)
+{
+    bool non_negative = false;
+    long length_of = no_array;
+    std::set<long> below_length;
+    switch (v.kind) {
+    case value_kind_t::constant_: non_negative = v.a >= 0; break;
+    case value_kind_t::local_:
+        non_negative = s.non_negative[v.a];
+        length_of = s.length_of[v.a];
+        below_length = s.below_length[v.a];
+        break;
+    case value_kind_t::length_:
+        non_negative = true;
+        length_of = v.b;
+        break;
+    case value_kind_t::sum_: {
+        auto &below = s.below_length[v.a];
+        // a local below the length of an array is small enough for a small constant to be
+        // added without overflow
+        auto small = v.b == 0 || (!below.empty() && v.b <= INT_MAX);
+        non_negative = s.non_negative[v.a] && v.b >= 0 && small;
+        if (v.b <= 0) {
+            below_length = below;
+        }
+        break;
+    }
+    default: break;
+    }
+    // the fields of `this` are those of another object once local 0 is assigned
+    forget(s, x, [x](long array) { return array == x || (x == 0 && array < 0); });
+    s.non_negative[x] = non_negative;
+    s.length_of[x] = length_of;
+    s.below_length[x] = std::move(below_length);
+}
+
+// the value of lhs < rhs
+static value_t less_than(const bounds_state_t &s, const value_t &lhs, const value_t &rhs)
+{
+    value_t result;
+    auto array = no_array;
+    if (rhs.kind == value_kind_t::length_) {
+        array = rhs.b;
+    }
+    else if (rhs.kind == value_kind_t::local_) {
+        array = s.length_of[rhs.a];
+    }
+    if (lhs.kind == value_kind_t::local_ && array != no_array) {
+        result.kind = value_kind_t::condition_;
+        result.bounds.emplace_back(lhs.a, array);
+    }
+    return result;
+}
+
+// the state after the instruction `i`
+static void step(const bytecode::instruction_t &i, bounds_state_t &s)
+{
+    auto &stack = s.stack;
+    auto top = [&stack](size_t k) -> value_t & { return stack[stack.size() - 1 - k]; };
+    value_t result;
+    switch (i.op_code) {
+    case op_code_t::band_: {
+        auto &lhs = top(1);
+        auto &rhs = top(0);
+        // both operands hold when the conjunction is true
+        for (auto v : {&lhs, &rhs}) {
+            if (v->kind == value_kind_t::condition_) {
+                result.kind = value_kind_t::condition_;
+                auto &bounds = result.bounds;
+                bounds.insert(bounds.end(), v->bounds.begin(), v->bounds.end());
+            }
+        }
+        break;
+    }
+    case op_code_t::getfield_:
+        if (top(0).kind == value_kind_t::local_ && top(0).a == 0) {
+            result = value_t{value_kind_t::array_, 0, field_array(i.operand)};
+        }
+        break;
+    case op_code_t::iadd_: {
+        auto &lhs = top(1);
+        auto &rhs = top(0);
+        if (lhs.kind == value_kind_t::local_ && rhs.kind == value_kind_t::constant_) {
+            result = value_t{value_kind_t::sum_, lhs.a, rhs.a};
+        }
+        else if (lhs.kind == value_kind_t::constant_ && rhs.kind == value_kind_t::local_) {
+            result = value_t{value_kind_t::sum_, rhs.a, lhs.a};
+        }
+        break;
+    }
+    case op_code_t::ilt_: result = less_than(s, top(1), top(0)); break;
+    case op_code_t::invoke_:
+    case op_code_t::invoke_direct_:
+        // the callee may assign any field of `this`
+        stack.resize(stack.size() - i.pops());
+        forget(s, -1, [](long array) { return array < 0; });
+        stack.push_back(result);
+        return;
+    case op_code_t::isub_:
+        if (top(1).kind == value_kind_t::local_ && top(0).kind == value_kind_t::constant_ &&
+            top(0).a != LONG_MIN) {
+            result = value_t{value_kind_t::sum_, top(1).a, -top(0).a};
+        }
+        break;
+    case op_code_t::ldc_: result = value_t{value_kind_t::constant_, i.operand}; break;
+    case op_code_t::length_:
+        if (array_of(top(0)) != no_array) {
+            result = value_t{value_kind_t::length_, 0, array_of(top(0))};
+        }
+        break;
+    case op_code_t::load_: result = value_t{value_kind_t::local_, i.operand}; break;
+    case op_code_t::putfield_: {
+        auto field = field_array(i.operand);
+        stack.resize(stack.size() - i.pops());
+        forget(s, -1, [field](long array) { return array == field; });
+        return;
+    }
+    case op_code_t::store_: {
+        auto v = top(0);
+        stack.pop_back();
+        assign(s, i.operand, v);
+        return;
+    }
+    default: break;
+    }
+    stack.resize(stack.size() - i.pops());
+    if (i.pushes() > 0) {
+        stack.push_back(result);
+    }
+}
+
+// merge the state of another path into `s`, returns whether `s` changed
+static bool join(bounds_state_t &s, const bounds_state_t &other)
+{
+    auto changed = false;
+    for (size_t d = 0; d < s.stack.size(); ++d) {
+        if (s.stack[d].kind != value_kind_t::unknown_ && !(s.stack[d] == other.stack[d])) {
+            s.stack[d] = value_t{};
+            changed = true;
+        }
+    }
+    for (size_t x = 0; x < s.non_negative.size(); ++x) {
+        if (s.non_negative[x] && !other.non_negative[x]) {
+            s.non_negative[x] = false;
+            changed = true;
+        }
+        if (s.length_of[x] != other.length_of[x] && s.length_of[x] != no_array) {
+            s.length_of[x] = no_array;
+            changed = true;
+        }
+        auto &arrays = s.below_length[x];
+        for (auto it = arrays.begin(); it != arrays.end();) {
+            if (other.below_length[x].count(*it) == 0) {
+                it = arrays.erase(it);
+                changed = true;
+            }
+            else {
+                ++it;
+            }
+        }
+    }
+    return changed;
+}
+
+// An index is in bounds when it is a local known to be non negative and below the length
+// of the array. Facts about the locals are found by a forward data flow analysis over the
+// control flow graph of the method: a local is non negative after being assigned a non
+// negative constant, a length, or itself plus a small positive constant, and it is below
+// the length of an array on the true branch of a `<` comparison with that length (or with
+// a local holding it), be it an ilt_ or a fused if_ige_ or if_ilt_ branch. A loop
+// counting up from 0 to the length of an array thus indexes it without bounds checks, as
+// long as the array is held by a local or a field of `this` which the loop does not
+// assign.
+void eliminate_bounds_checks(method_layout_t &method)
+{
+    auto &instructions = method.instructions;
+    long nlocals = method.local_refs.size();
+    std::vector<bounds_state_t> states(instructions.size());
+    auto &entry = states[0];
+    entry.reached = true;
+    entry.non_negative.assign(nlocals, false);
+    entry.length_of.assign(nlocals, no_array);
+    entry.below_length.resize(nlocals);
+    // locals start at 0, unlike the arguments
+    for (long x = 1 + method.args.size(); x < nlocals; ++x) {
+        entry.non_negative[x] = true;
+    }
+    std::vector<size_t> worklist{0};
+    while (!worklist.empty()) {
+        auto pc = worklist.back();
+        worklist.pop_back();
+        auto &i = instructions[pc];
+        if (i.op_code == op_code_t::return_) {
+            continue;
+        }
+        auto after = states[pc];
+        // the bounds holding on the edge of a conditional branch to true_pc, unless both
+        // edges lead to the same instruction
+        std::vector<std::pair<long, long>> if_true;
+        auto true_pc = pc + 1;
+        auto &stack = after.stack;
+        switch (i.op_code) {
+        case op_code_t::goto_if_false_: if_true = stack.back().bounds; break;
+        case op_code_t::if_ige_:
+            if_true = less_than(after, stack[stack.size() - 2], stack.back()).bounds;
+            break;
+        case op_code_t::if_ilt_:
+            if_true = less_than(after, stack[stack.size() - 2], stack.back()).bounds;
+            true_pc = i.operand;
+            break;
+        default: break;
+        }
+        if (static_cast<size_t>(i.operand) == pc + 1) {
+            if_true.clear();
+        }
+        step(i, after);
+        for (auto next : successors(i, pc)) {
+            auto out = after;
+            if (next == true_pc) {
+                for (auto &bound : if_true) {
+                    out.below_length[bound.first].insert(bound.second);
+                }
+            }
+            if (!states[next].reached) {
+                states[next] = std::move(out);
+                worklist.push_back(next);
+            }
+            else if (join(states[next], out)) {
+                worklist.push_back(next);
+            }
+        }
+    }
+    for (size_t pc = 0; pc < instructions.size(); ++pc) {
+        auto &s = states[pc];
+        auto &i = instructions[pc];
+        if (!s.reached ||
+            (i.op_code != op_code_t::iaload_ && i.op_code != op_code_t::iastore_)) {
+            continue;
+        }
+        auto &array = s.stack.back();
+        auto &index = s.stack[s.stack.size() - i.pops()];
+        if (index.kind != value_kind_t::local_ || !s.non_negative[index.a] ||
+            s.below_length[index.a].count(array_of(array)) == 0) {
+            continue;
+        }
+        auto load = i.op_code == op_code_t::iaload_;
+        i.op_code = load ? op_code_t::iaload_nc_ : op_code_t::iastore_nc_;
+    }
+}
+
+} // namespace bc_compiler
@@ -0,0 +1,287 @@
+#include <algorithm>
+#include <sstream>
+
+#include <bytecode.h>
+
+// ============================================================================
+// C backend
+// ============================================================================
+
+namespace bc_compiler {
+
+using bytecode::instruction_t;
+using bytecode::op_code_t;
+
+// Translation of the stack bytecode of a program to C, run on the runtime of the
+// interpreter: the GC and the VM stack, which only holds the frames for the collector.
+// Every method becomes a C function, whose locals and operand stack slots are C variables
+// at the depths known from the verifier. At a safepoint, the slots holding references are
+// stored into the frame of the function, where the collector finds them with the stack
+// maps of the method, and loaded back once the objects they point to may have moved.
+struct c_emitter_t {
+    const std::vector<class_layout_t> &classes;
+    const std::vector<method_layout_t> &methods;
+    std::ostream &out;
+    std::string function(size_t m)
+    {
+        auto &name = methods[m].method_name;
+        return "m" + std::to_string(m) + "_" + name.first + "_" + name.second;
+    }
+    long method_index(const std::pair<std::string, std::string> &name)
+    {
+        auto m = std::find_if(
+            methods.begin(), methods.end(),
+            [&name](const method_layout_t &m) { return m.method_name == name; });
+        return std::distance(methods.begin(), m);
+    }
+    void prototype(size_t m)
+    {
+        out << "static int64_t " << function(m) << "(";
+        auto nargs = methods[m].args.size() + 1;
+        for (size_t a = 0; a < nargs; ++a) {
+            out << (a ? ", " : "") << "int64_t l" << a;
+        }
+        out << ")";
+    }
+    void classes_and_maps();
+    void method(size_t m);
+    void emit();
+};
+
+void c_emitter_t::classes_and_maps()
+{
+    for (size_t c = 0; c < classes.size(); ++c) {
+        auto &cl = classes[c];
+        auto id = std::to_string(c);
+        out << "// class " << cl.name << "\n";
+        out << "static const int32_t ref_fields_" << id << "[] = {";
+        for (auto f : cl.ref_fields) {
+            out << f << ", ";
+        }
+        out << "-1};\n";
+        out << "static class_info_t class_" << id << " = {{" << cl.ref_fields.size()
+            << ", ref_fields_" << id << "}, " << id << ", " << cl.interval.preorder << ", "
+            << cl.interval.last_descendant << ", " << cl.fields.size() << ", "
+            << cl.vtbl.size() << ", {";
+        for (auto &m : cl.vtbl) {
+            auto index = method_index(m);
+            out << "{(void *)" << function(index) << ", " << index << "}, ";
+        }
+        out << "}};\n\n";
+    }
+    // a method is identified by an array with one byte per instruction, standing for its
+    // code in the frames
+    for (size_t m = 0; m < methods.size(); ++m) {
+        auto &method = methods[m];
+        auto id = std::to_string(m);
+        out << "static char code_" << id << "[" << method.instructions.size() << "];\n";
+        for (size_t pc = 0; pc < method.stack_maps.size(); ++pc) {
+            if (!method.instructions[pc].is_safepoint()) {
+                continue;
+            }
+            out << "static const int32_t map_" << id << "_" << pc << "[] = {";
+            for (auto r : method.stack_maps[pc]) {
+                out << r << ", ";
+            }
+            out << "-1};\n";
+        }
+        out << "static ref_map_t maps_" << id << "[" << method.instructions.size()
+            << "] = {\n";
+        for (size_t pc = 0; pc < method.stack_maps.size(); ++pc) {
+            if (method.instructions[pc].is_safepoint()) {
+                out << "    [" << pc << "] = {" << method.stack_maps[pc].size() << ", map_"
+                    << id << "_" << pc << "},\n";
+            }
+        }
+        out << "};\n\n";
+    }
+}
+
+void c_emitter_t::method(size_t m)
+{
+    auto &method = methods[m];
+    auto &code = method.instructions;
+    auto id = std::to_string(m);
+    auto depths = stack_depths(method);
+    long base = 1 + method.args.size() + method.locals.size();
+    auto var = [base](long slot) {
+        return slot < base ? "l" + std::to_string(slot) : "s" + std::to_string(slot - base);
+    };
+    auto targets = std::vector<bool>(code.size());
+    for (size_t pc = 0; pc < code.size(); ++pc) {
+        if (depths[pc] != -1 && code[pc].is_branch()) {
+            targets[code[pc].operand] = true;
+        }
+    }
+    out << "// " << method.method_name.first << "." << method.method_name.second << "\n";
+    prototype(m);
+    out << "\n{\n";
+    for (long l = method.args.size() + 1; l < base; ++l) {
+        out << "    int64_t l" << l << " = 0;\n";
+    }
+    for (size_t s = 0; s < method.max_stack; ++s) {
+        out << "    int64_t s" << s << " = 0;\n";
+    }
+    out << "    frame_t *f = frame_push(fp->sp, 0, " << base + method.max_stack
+        << ", 0);\n";
+    out << "    f->ip_start = code_" << id << ";\n";
+    for (size_t pc = 0; pc < code.size(); ++pc) {
+        if (depths[pc] == -1) {
+            continue;
+        }
+        if (targets[pc]) {
+            out << "L" << pc << ":\n";
+        }
+        auto &i = code[pc];
+        long d = depths[pc];
+        // the operands of the instruction, from the top of the stack
+        auto s = [&](long k) { return var(base + d - 1 - k); };
+        auto to = [&](long target) { return "goto L" + std::to_string(target) + ";"; };
+        auto hval = [](const std::string &v) { return "((heapval_t *)" + v + ")"; };
+        // the references of the frame go through the frame across a safepoint
+        auto safepoint = [&](const std::string &statement) {
+            for (auto r : method.stack_maps[pc]) {
+                out << "    f->locals[" << r << "] = (void *)" << var(r) << ";\n";
+            }
+            out << "    f->ip = code_" << id << " + " << pc << ";\n";
+            out << "    " << statement << "\n";
+            for (auto r : method.stack_maps[pc]) {
+                out << "    " << var(r) << " = (int64_t)f->locals[" << r << "];\n";
+            }
+        };
+        std::ostringstream c;
+        switch (i.op_code) {
+        case op_code_t::band_: c << s(1) << " &= " << s(0) << ";"; break;
+        case op_code_t::bneg_: c << s(0) << " = !" << s(0) << ";"; break;
+        case op_code_t::getfield_:
+            c << s(0) << " = *pith_field(" << hval(s(0)) << ", " << i.operand << ");";
+            break;
+        case op_code_t::goto_: c << to(i.operand); break;
+        case op_code_t::goto_if_false_:
+            c << "if (!" << s(0) << ") " << to(i.operand);
+            break;
+        case op_code_t::guard_class_:
+            c << "if (hval_vtable(" << hval(var(i.operand2)) << ") != &class_"
+                << i.operand3 << ") " << to(i.operand);
+            break;
+        case op_code_t::iadd_:
+            c << s(1) << " = WRAP(" << s(1) << ", +, " << s(0) << ");";
+            break;
+        case op_code_t::iaload_:
+        case op_code_t::iaload_nc_:
+            c << s(1) << " = *pith_field_arr"
+                << (i.op_code == op_code_t::iaload_ ? "_checked(" : "(") << hval(s(0))
+                << ", " << s(1) << ");";
+            break;
+        case op_code_t::iastore_:
+        case op_code_t::iastore_nc_:
+            c << "*pith_field_arr" << (i.op_code == op_code_t::iastore_ ? "_checked(" : "(")
+                << hval(s(0)) << ", " << s(2) << ") = " << s(1) << ";";
+            break;
+        case op_code_t::if_false_:
+            c << "if (!" << var(i.operand2) << ") " << to(i.operand);
+            break;
+        case op_code_t::if_ige_:
+            c << "if (" << s(1) << " >= " << s(0) << ") " << to(i.operand);
+            break;
+        case op_code_t::if_ilt_:
+            c << "if (" << s(1) << " < " << s(0) << ") " << to(i.operand);
+            break;
+        case op_code_t::if_true_:
+            c << "if (" << var(i.operand2) << ") " << to(i.operand);
+            break;
+        case op_code_t::ilt_: c << s(1) << " = " << s(1) << " < " << s(0) << ";"; break;
+        case op_code_t::imul_:
+            c << s(1) << " = WRAP(" << s(1) << ", *, " << s(0) << ");";
+            break;
+        case op_code_t::invoke_:
+        case op_code_t::invoke_direct_: {
+            std::string args, types;
+            for (long a = i.operand2 - 1; a >= 0; --a) {
+                args += s(a) + (a ? ", " : "");
+                types += a ? "int64_t, " : "int64_t";
+            }
+            auto callee = function(i.operand);
+            if (i.op_code == op_code_t::invoke_) {
+                callee = "((int64_t(*)(" + types + "))VIRTUAL(" + s(i.operand2 - 1) + ", " +
+                         std::to_string(i.operand) + "))";
+            }
+            safepoint(s(i.operand2 - 1) + " = " + callee + "(" + args + ");");
+            continue;
+        }
+        case op_code_t::isub_:
+            c << s(1) << " = WRAP(" << s(1) << ", -, " << s(0) << ");";
+            break;
+        case op_code_t::load_: c << s(-1) << " = " << var(i.operand) << ";"; break;
+        case op_code_t::ldc_: c << s(-1) << " = " << i.operand << ";"; break;
+        case op_code_t::length_: c << s(0) << " = " << hval(s(0)) << "->size;"; break;
+        case op_code_t::new_:
+            safepoint(s(-1) + " = (int64_t)alloc_heapval(&class_" +
+                      std::to_string(i.operand) + ", " +
+                      std::to_string(classes[i.operand].fields.size()) + ");");
+            continue;
+        case op_code_t::newarray_:
+            safepoint(s(0) + " = (int64_t)alloc_arr(" + s(0) + ");");
+            continue;
+        case op_code_t::putfield_:
+            c << "write_barrier(" << hval(s(0)) << ", (void *)" << s(1) << ");\n";
+            c << "    *pith_field(" << hval(s(0)) << ", " << i.operand << ") = " << s(1)
+                << ";";
+            break;
+        case op_code_t::print_: c << "printf(\"%\" PRId64 \"\\n\", " << s(0) << ");"; break;
+        case op_code_t::return_:
+            c << "frame_pop();\n";
+            c << "    return " << (d == 0 ? "0" : s(0)) << ";";
+            break;
+        case op_code_t::store_: c << var(i.operand) << " = " << s(0) << ";"; break;
+        default:
+            std::cerr << "C backend: unexpected instruction " << i.as_str() << std::endl;
+            exit(1);
+        }
+        out << "    " << c.str() << "\n";
+    }
+    out << "}\n\n";
+}
+
+void c_emitter_t::emit()
+{
+    out << "// generated from MiniJava by the C backend of MiniVM\n"
+           "#include <inttypes.h>\n"
+           "#include <stdio.h>\n"
+           "#include <stdlib.h>\n\n"
+           "#include <runtime.h>\n\n"
+           "// every local and class gets a variable, used or not\n"
+           "#pragma GCC diagnostic ignored \"-Wunused-variable\"\n"
+           "#pragma GCC diagnostic ignored \"-Wunused-but-set-variable\"\n\n"
+           "// ints wrap around as in Java\n"
+           "#define WRAP(a, op, b) ((int64_t)((uint64_t)(a)op(uint64_t)(b)))\n"
+           "#define VIRTUAL(obj, m) \\\n"
+           "    (((class_info_t *)hval_vtable((heapval_t *)(obj)))->methods[m].code)\n"
+           "\n";
+    for (size_t m = 0; m < methods.size(); ++m) {
+        prototype(m);
+        out << ";\n";
+    }
+    out << "\n";
+    classes_and_maps();
+    for (size_t m = 0; m < methods.size(); ++m) {
+        method(m);
+    }
+    out << "int main(void)\n{\n"
+           "    vm_stack_init();\n"
+           "    heap_init();\n";
+    for (size_t m = 0; m < methods.size(); ++m) {
+        out << "    register_stack_maps(code_" << m << ", 1, maps_" << m << ");\n";
+    }
+    out << "    " << function(0) << "(0);\n"
+        << "    return 0;\n}\n";
+}
+
+void emit_c(const std::vector<class_layout_t> &classes,
+            const std::vector<method_layout_t> &methods)
+{
+    c_emitter_t emitter{classes, methods, std::cout};
+    emitter.emit();
+}
+
+} // namespace bc_compiler
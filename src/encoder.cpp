@@ -0,0 +1,88 @@
+#include <limits>
+
+#include <bytecode.h>
+
+// ============================================================================
+// Compact encoding
+// ============================================================================
+
+namespace bc_compiler {
+
+using bytecode::op_code_t;
+
+void encode(method_layout_t &method)
+{
+    auto &instructions = method.instructions;
+    auto &offsets = method.code_offsets;
+    offsets.resize(instructions.size() + 1);
+    offsets[0] = 0;
+    for (size_t pc = 0; pc < instructions.size(); ++pc) {
+        offsets[pc + 1] = offsets[pc] + bytecode::encoded_size(instructions[pc].op_code);
+    }
+    auto &code = method.code;
+    code.clear();
+    code.reserve(offsets.back());
+    for (size_t pc = 0; pc < instructions.size(); ++pc) {
+        auto &i = instructions[pc];
+        auto put = [&](long value, auto type) {
+            using T = decltype(type);
+            if (value < std::numeric_limits<T>::min() ||
+                value > std::numeric_limits<T>::max()) {
+                std::cerr << "error: " << method.method_name.first << "."
+                          << method.method_name.second << ": operand " << value
+                          << " too large for the encoding of " << i.as_str()
+                          << " at instruction " << pc << std::endl;
+                exit(1);
+            }
+            auto v = static_cast<T>(value);
+            auto bytes = reinterpret_cast<const uint8_t *>(&v);
+            code.insert(code.end(), bytes, bytes + sizeof(T));
+        };
+        auto index = [&](long value) { put(value, uint16_t{}); };
+        auto constant = [&](long value) { put(value, int32_t{}); };
+        auto target = [&](long value) { put(offsets.at(value), uint32_t{}); };
+        code.push_back(static_cast<uint8_t>(i.op_code));
+        switch (i.op_code) {
+        case op_code_t::getfield_:
+        case op_code_t::load_:
+        case op_code_t::new_:
+        case op_code_t::putfield_:
+        case op_code_t::store_: index(i.operand); break;
+        case op_code_t::ldc_: constant(i.operand); break;
+        case op_code_t::goto_:
+        case op_code_t::goto_if_false_:
+        case op_code_t::if_ige_:
+        case op_code_t::if_ilt_: target(i.operand); break;
+        case op_code_t::if_false_:
+        case op_code_t::if_true_:
+            target(i.operand);
+            index(i.operand2);
+            break;
+        case op_code_t::guard_class_:
+            target(i.operand);
+            index(i.operand2);
+            index(i.operand3);
+            break;
+        case op_code_t::invoke_:
+        case op_code_t::invoke_direct_:
+            index(i.operand);
+            put(i.operand2, uint8_t{});
+            put(i.operand3, uint32_t{});
+            break;
+        case op_code_t::load_getfield_:
+        case op_code_t::load_load_:
+        case op_code_t::load_load_if_ige_:
+            index(i.operand);
+            index(i.operand2);
+            break;
+        case op_code_t::load_ldc_iadd_:
+        case op_code_t::load_ldc_isub_:
+            index(i.operand);
+            constant(i.operand2);
+            break;
+        default: break;
+        }
+    }
+}
+
+} // namespace bc_compiler
@@ -1,9 +1,16 @@
+#include <algorithm>
+#include <chrono>
+#include <cstring>
 #include <iostream>
-#include <list>
 #include <string>
+#include <thread>
+#include <unordered_map>
 #include <vector>
 
+#include <sys/mman.h>
+
 #include <runtime.h>
+#include <ws_deque.h>
 
 // ============================================================================
 // Garbage collector
@@ -11,50 +18,391 @@
 
 int64_t mem;
 int64_t max_mem = 128 * (1ULL << 20); // 128MB
+int gc_threads = 1;
+
+#define NURSERY_SIZE (8ULL << 20) // 8MB
+// objects larger than this are allocated in the old space directly
+#define MAX_YOUNG_SIZE (NURSERY_SIZE / 16)
+
+uint8_t *nursery_start;
+uint8_t *nursery_end;
+uint8_t *nursery_top;
+
+gc_stats_t gc_stats;
 
 std::vector<heapval_t *> worklist;
-std::list<heapval_t *> heap;
+std::vector<heapval_t *> remembered_set;
+
+static void *reserve(size_t size);
+
+namespace gc {
+void minor(void);
+void gc(void);
+
+// run a collection, recording its pause
+template <typename F> void pause(pause_stats_t &stats, F collect)
+{
+    auto start = std::chrono::steady_clock::now();
+    collect();
+    std::chrono::duration<double, std::milli> ms = std::chrono::steady_clock::now() - start;
+    stats.count++;
+    stats.total_ms += ms.count();
+    stats.max_ms = std::max(stats.max_ms, ms.count());
+}
+}
+
+// ============================================================================
+// Old space
+// ============================================================================
+
+// The old space is a single reserved region divided in pages of PAGE_SIZE bytes aligned
+// on PAGE_SIZE. A small page only holds cells of one size class, the size classes being
+// the multiples of 8 bytes up to 256 bytes, then four classes per power of two up to
+// MAX_SMALL_SIZE. A larger object, typically a big array, gets a run of pages of its own
+// in the large object space. Marks and remembered bits are kept in side bitmaps with one
+// bit per granule of the region, so that the headers of the objects are never written by
+// the collector.
+
+#define HEAP_SIZE (1ULL << 30) // 1GB of address space
+#define PAGE_SIZE (64ULL << 10) // 64KB
+#define HEAP_PAGES (HEAP_SIZE / PAGE_SIZE)
+#define GRANULE sizeof(int64_t)
+#define MAX_SMALL_SIZE (PAGE_SIZE / 8) // 8KB
+#define MAX_TINY_SIZE 256
+#define NUM_SIZE_CLASSES (MAX_TINY_SIZE / GRANULE + 1 + 4 * 5)
+// the largest number of slots of an object: its size in bytes neither wraps around nor goes
+// past the heap, and never reads as the -1 size of a free cell
+#define MAX_SLOTS ((HEAP_SIZE - sizeof(heapval_t)) / sizeof(int64_t))
+
+typedef struct {
+    size_t cell_size; // 0 for the pages of a large object
+    size_t npages;
+    uint8_t *cells;
+    uint8_t *cells_end;
+} page_t;
+
+// a free cell, recognized by its negative size
+typedef struct free_cell {
+    struct free_cell *next;
+    int64_t size;
+} free_cell_t;
+
+typedef struct {
+    free_cell_t *free_list;
+    std::vector<page_t *> pages; // swept since the last marking
+    std::vector<page_t *> unswept;
+} size_class_t;
+
+uint8_t *heap_start;
+uint8_t *heap_end;
+uint8_t *heap_top; // end of the highest page ever used
+uint64_t used_pages[HEAP_PAGES / 64];
+uint64_t *mark_bits;
+uint64_t *remembered_bits;
+size_class_t size_classes[NUM_SIZE_CLASSES];
+std::vector<heapval_t *> large_objects;
+
+// size class of an object of at most MAX_SMALL_SIZE bytes
+static size_t size_class_of(size_t bytes)
+{
+    if (bytes <= MAX_TINY_SIZE) {
+        return bytes / GRANULE;
+    }
+    // 2^p < bytes <= 2^(p + 1), in steps of a quarter of 2^p
+    size_t p = 63 - __builtin_clzll(bytes - 1);
+    size_t step = (1ULL << p) / 4;
+    return MAX_TINY_SIZE / GRANULE + (p - 8) * 4 + (bytes - (1ULL << p) + step - 1) / step;
+}
+
+static size_t cell_size_of(size_t size_class)
+{
+    if (size_class <= MAX_TINY_SIZE / GRANULE) {
+        return size_class * GRANULE;
+    }
+    auto i = size_class - MAX_TINY_SIZE / GRANULE - 1;
+    size_t p = 8 + i / 4;
+    return (1ULL << p) + (i % 4 + 1) * ((1ULL << p) / 4);
+}
+
+static page_t *page_of(void *ptr)
+{
+    return reinterpret_cast<page_t *>(reinterpret_cast<uintptr_t>(ptr) & ~(PAGE_SIZE - 1));
+}
+
+static bool is_marked(void *ptr)
+{
+    auto bit = granule_of(ptr);
+    return mark_bits[bit / 64] & (1ULL << (bit % 64));
+}
+
+// first-fit allocation of a run of `n` pages
+static page_t *alloc_pages(size_t n)
+{
+    size_t run = 0;
+    for (size_t i = 0; i < HEAP_PAGES; i++) {
+        if (i % 64 == 0 && used_pages[i / 64] == ~0ULL) {
+            run = 0;
+            i += 63;
+            continue;
+        }
+        if (used_pages[i / 64] & (1ULL << (i % 64))) {
+            run = 0;
+            continue;
+        }
+        if (++run < n) {
+            continue;
+        }
+        auto first = i + 1 - n;
+        for (auto j = first; j <= i; j++) {
+            used_pages[j / 64] |= 1ULL << (j % 64);
+        }
+        auto page = reinterpret_cast<page_t *>(heap_start + first * PAGE_SIZE);
+        heap_top = std::max(heap_top, reinterpret_cast<uint8_t *>(page) + n * PAGE_SIZE);
+        page->npages = n;
+        page->cells = reinterpret_cast<uint8_t *>(page) +
+                      (sizeof(page_t) + GRANULE - 1) / GRANULE * GRANULE;
+        page->cells_end = reinterpret_cast<uint8_t *>(page) + n * PAGE_SIZE;
+        return page;
+    }
+    std::cerr << "Out of memory" << std::endl;
+    exit(1);
+}
+
+static void free_pages(page_t *page)
+{
+    auto first = (reinterpret_cast<uint8_t *>(page) - heap_start) / PAGE_SIZE;
+    for (auto j = first; j < first + page->npages; j++) {
+        used_pages[j / 64] &= ~(1ULL << (j % 64));
+    }
+}
+
+// chain the free cells of a page to the free list of its size class, returns the number
+// of live cells. When sweeping, the unmarked cells are freed and the marks of the page are
+// cleared.
+static size_t page_free_cells(page_t *page, size_class_t &sc, bool sweep)
+{
+    size_t live = 0;
+    for (auto cell = page->cells; cell + page->cell_size <= page->cells_end;
+         cell += page->cell_size) {
+        auto val = reinterpret_cast<heapval_t *>(cell);
+        if (sweep && val->size >= 0 && is_marked(cell)) {
+            live++;
+            continue;
+        }
+        auto free_cell = reinterpret_cast<free_cell_t *>(cell);
+        free_cell->size = -1;
+        free_cell->next = sc.free_list;
+        sc.free_list = free_cell;
+    }
+    if (sweep) {
+        std::memset(mark_bits + granule_of(page) / 64, 0, PAGE_SIZE / GRANULE / 8);
+    }
+    return live;
+}
+
+// sweep an unswept page of a size class, returns false if there is none left
+static bool sweep_page(size_class_t &sc)
+{
+    if (sc.unswept.empty()) {
+        return false;
+    }
+    auto page = sc.unswept.back();
+    sc.unswept.pop_back();
+    auto free_list = sc.free_list;
+    // an empty page is kept if its cells are needed, so that the allocator sweeps one page
+    // at a time
+    if (page_free_cells(page, sc, true) == 0 && free_list != nullptr) {
+        // drop the cells of the page from the free list
+        sc.free_list = free_list;
+        free_pages(page);
+    }
+    else {
+        sc.pages.push_back(page);
+    }
+    return true;
+}
+
+static page_t *new_page(size_t size_class)
+{
+    auto page = alloc_pages(1);
+    page->cell_size = cell_size_of(size_class);
+    auto &sc = size_classes[size_class];
+    sc.pages.push_back(page);
+    page_free_cells(page, sc, false);
+    return page;
+}
+
+// allocate an uninitialized object of the old space, without triggering a collection
+static heapval_t *old_alloc(size_t size)
+{
+    mem += size;
+    if (size > MAX_SMALL_SIZE) {
+        auto bytes = (sizeof(page_t) + GRANULE - 1) / GRANULE * GRANULE + size;
+        auto page = alloc_pages((bytes + PAGE_SIZE - 1) / PAGE_SIZE);
+        page->cell_size = 0;
+        auto val = reinterpret_cast<heapval_t *>(page->cells);
+        large_objects.push_back(val);
+        return val;
+    }
+    auto size_class = size_class_of(size);
+    auto &sc = size_classes[size_class];
+    // sweep pages left by the last marking until one has a free cell
+    while (sc.free_list == nullptr && sweep_page(sc)) {
+        gc_stats.lazily_swept_pages++;
+    }
+    if (sc.free_list == nullptr) {
+        new_page(size_class);
+    }
+    auto cell = sc.free_list;
+    sc.free_list = cell->next;
+    return reinterpret_cast<heapval_t *>(cell);
+}
+
+// collect if allocating `size` bytes in the old space would exceed `max_mem`
+static void old_reserve(size_t size)
+{
+    if (mem + size > max_mem) {
+        gc::pause(gc_stats.major, gc::gc);
+        if (mem + size > max_mem) {
+            std::cerr << "Out of memory" << std::endl;
+            exit(1);
+        }
+    }
+}
 
 heapval_t *alloc_heapval(void *vtable, size_t size)
 {
-    auto val = reinterpret_cast<heapval_t *>(
-        managed_alloc(sizeof(heapval_t) + size * sizeof(int64_t)));
+    if (size > MAX_SLOTS) {
+        std::cerr << "Out of memory" << std::endl;
+        exit(1);
+    }
+    size_t bytes = sizeof(heapval_t) + size * sizeof(int64_t);
+    heapval_t *val;
+    if (bytes > MAX_YOUNG_SIZE) {
+        old_reserve(bytes);
+        val = old_alloc(bytes);
+        std::memset(val, 0, bytes);
+    }
+    else {
+        if (nursery_top + bytes > nursery_end) {
+            gc::pause(gc_stats.minor, gc::minor);
+            if (mem > max_mem) {
+                gc::pause(gc_stats.major, gc::gc);
+                if (mem > max_mem) {
+                    std::cerr << "Out of memory" << std::endl;
+                    exit(1);
+                }
+            }
+        }
+        val = reinterpret_cast<heapval_t *>(nursery_top);
+        nursery_top += bytes;
+        std::memset(val, 0, bytes);
+    }
     val->vtable = vtable;
     val->size = size;
-    heap.emplace_back(val);
     return val;
 }
 
-heapval_t *alloc_arr(size_t size)
+// arrays have no reference to trace
+class_info_t array_info = {{0, nullptr}, -1, -1, -1, 0, 0};
+
+heapval_t *alloc_arr(int64_t len)
 {
-    heapval_t *val = reinterpret_cast<heapval_t *>(managed_alloc(sizeof(heapval_t)));
-    auto buf = reinterpret_cast<int64_t *>(managed_alloc(size * sizeof(int64_t)));
-    val->vtable = buf;
-    val->tag = VAL_ARRAY_TAG;
-    val->size = size;
-    heap.emplace_back(val);
-    return val;
+    if (len < 0) {
+        negative_array_size(len);
+    }
+    auto vtable = reinterpret_cast<int64_t>(&array_info) | VAL_ARRAY_TAG;
+    return alloc_heapval(reinterpret_cast<void *>(vtable), len);
+}
+
+void heap_init(void)
+{
+    // over-reserve to align the pages
+    auto region = reinterpret_cast<uintptr_t>(reserve(HEAP_SIZE + PAGE_SIZE));
+    heap_start = reinterpret_cast<uint8_t *>((region + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1));
+    heap_end = heap_start + HEAP_SIZE;
+    heap_top = heap_start;
+    mark_bits = reinterpret_cast<uint64_t *>(reserve(HEAP_SIZE / GRANULE / 8));
+    remembered_bits = reinterpret_cast<uint64_t *>(reserve(HEAP_SIZE / GRANULE / 8));
+    nursery_start = reinterpret_cast<uint8_t *>(reserve(NURSERY_SIZE));
+    nursery_end = nursery_start + NURSERY_SIZE;
+    nursery_top = nursery_start;
+}
+
+void remember(heapval_t *obj)
+{
+    auto bit = granule_of(obj);
+    remembered_bits[bit / 64] |= 1ULL << (bit % 64);
+    remembered_set.push_back(obj);
 }
 
-frame_t *frame_create(void)
+// ============================================================================
+// VM stack
+// ============================================================================
+
+#define VM_STACK_SLOTS (1ULL << 24)
+#define VM_STACK_FRAMES (1ULL << 20)
+
+void **vm_stack;
+void **vm_stack_limit;
+frame_t *frames;
+frame_t *frames_limit;
+frame_t *fp;
+
+static void *reserve(size_t size)
 {
-    auto p = std::malloc(sizeof(frame_t));
-    if (p == NULL) {
+    // only reserve address space, pages are committed on first touch
+    auto p = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                  MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (p == MAP_FAILED) {
         std::cerr << "Out of memory" << std::endl;
         exit(1);
     }
-    auto frame = reinterpret_cast<frame_t *>(p);
-    vector_init(&frame->val_stack, 16);
-    vector_init(&frame->locals, 16);
-    frame->ip = NULL;
-    return frame;
+    return p;
+}
+
+typedef struct {
+    size_t insn_size;
+    const ref_map_t *maps;
+} stack_maps_t;
+
+// stack maps by the first instruction of their method
+std::unordered_map<void *, stack_maps_t> stack_maps;
+
+void register_stack_maps(void *code, size_t insn_size, const ref_map_t *maps)
+{
+    stack_maps[code] = stack_maps_t{insn_size, maps};
+}
+
+// call `visit` on each slot of the VM stack holding a reference
+template <typename F> static void for_each_root(F visit)
+{
+    const stack_maps_t *sm = nullptr;
+    void *code = nullptr;
+    for (auto frame = frames + 1; frame <= fp; frame++) {
+        // consecutive frames often run the same method
+        if (frame->ip_start != code) {
+            code = frame->ip_start;
+            sm = &stack_maps.at(code);
+        }
+        auto pc = (static_cast<uint8_t *>(frame->ip) - static_cast<uint8_t *>(code)) /
+                  sm->insn_size;
+        auto &map = sm->maps[pc];
+        for (int64_t i = 0; i < map.nrefs; i++) {
+            visit(frame->locals + map.refs[i]);
+        }
+    }
 }
 
-void frame_destroy(frame_t *frame)
+void vm_stack_init(void)
 {
-    vector_destroy(&frame->val_stack);
-    vector_destroy(&frame->locals);
-    free(frame);
+    vm_stack = reinterpret_cast<void **>(reserve(VM_STACK_SLOTS * sizeof(void *)));
+    vm_stack_limit = vm_stack + VM_STACK_SLOTS;
+    frames = reinterpret_cast<frame_t *>(reserve(VM_STACK_FRAMES * sizeof(frame_t)));
+    frames_limit = frames + VM_STACK_FRAMES;
+    fp = frames;
+    fp->locals = fp->sp = vm_stack;
+    fp->ip = fp->ip_start = nullptr;
 }
 
 namespace gc {
@@ -71,16 +419,45 @@ void gc_log(std::string msg)
 void queue_roots(void)
 {
     gc_log("queue_roots");
-    frame_t *frame = nullptr;
-    for (size_t i = 0; i < frames.size; i++) {
-        frame = reinterpret_cast<frame_t *>(vector_get(&frames, i));
-        for (size_t j = 0; j < frame->val_stack.size; j++) {
-            auto val = reinterpret_cast<heapval_t *>(vector_get(&frame->val_stack, j));
-            worklist.push_back(val);
+    for_each_root([](void **slot) {
+        if (*slot != nullptr) {
+            worklist.push_back(ptr_to_hval(*slot));
         }
-        for (size_t j = 0; j < frame->locals.size; j++) {
-            auto val = reinterpret_cast<heapval_t *>(vector_get(&frame->locals, j));
-            worklist.push_back(val);
+    });
+}
+
+// set the mark of an object, returns false if it was already marked
+static bool set_mark(heapval_t *val)
+{
+    auto bit = granule_of(val);
+    auto &word = mark_bits[bit / 64];
+    if (word & (1ULL << (bit % 64))) {
+        return false;
+    }
+    word |= 1ULL << (bit % 64);
+    return true;
+}
+
+// same as `set_mark`, for concurrent markers
+static bool set_mark_atomic(heapval_t *val)
+{
+    auto bit = granule_of(val);
+    auto mask = 1ULL << (bit % 64);
+    auto &word = mark_bits[bit / 64];
+    if (__atomic_load_n(&word, __ATOMIC_RELAXED) & mask) {
+        return false;
+    }
+    return !(__atomic_fetch_or(&word, mask, __ATOMIC_RELAXED) & mask);
+}
+
+// queue the objects referenced by the fields of `val`
+template <typename F> static void trace_fields(heapval_t *val, F queue)
+{
+    auto map = hval_ref_map(val);
+    for (int64_t i = 0; i < map->nrefs; i++) {
+        auto field = reinterpret_cast<heapval_t *>(*pith_field(val, map->refs[i]));
+        if (field != nullptr) {
+            queue(ptr_to_hval(field));
         }
     }
 }
@@ -94,74 +471,182 @@ void mark(void)
         }
         auto val = worklist.back();
         worklist.pop_back();
-        if (val == nullptr) {
+        if (!set_mark(val)) {
             continue;
         }
-        int64_t ival = reinterpret_cast<int64_t>(val);
-        if (ival & VAL_INT_TAG) {
-            continue;
-        }
-        val->tag |= MARKED_TAG;
-        if (val->tag & VAL_ARRAY_TAG) {
-            continue;
-        }
-        auto fstart = reinterpret_cast<int64_t *>(reinterpret_cast<uint8_t *>(val) +
-                                                  sizeof(heapval_t));
-        auto fend = fstart + val->size;
-        for (int64_t *p = fstart; p < fend; p++) {
-            auto val = reinterpret_cast<heapval_t *>(*p);
-            worklist.push_back(val);
+        mem += sizeof(heapval_t) + val->size * sizeof(int64_t);
+        trace_fields(val, [](heapval_t *field) { worklist.push_back(field); });
+    }
+}
+
+// Marking with `gc_threads` threads. The roots are dealt out to a work-stealing deque per
+// thread; a thread whose deque runs dry steals from the others, and marking is over when
+// all the threads are idle at the same time.
+void parallel_mark(void)
+{
+    gc_log("parallel_mark");
+    size_t nthreads = gc_threads;
+    std::vector<std::unique_ptr<ws_deque_t<heapval_t *>>> deques;
+    for (size_t i = 0; i < nthreads; i++) {
+        deques.emplace_back(new ws_deque_t<heapval_t *>());
+    }
+    size_t next = 0;
+    for (auto val : worklist) {
+        deques[next++ % nthreads]->push(val);
+    }
+    worklist.clear();
+    std::atomic<size_t> idle{0};
+    std::atomic<int64_t> live{0};
+    auto worker = [&](size_t id) {
+        auto &deque = *deques[id];
+        int64_t bytes = 0;
+        size_t victim = id;
+        while (true) {
+            auto val = deque.pop();
+            for (size_t i = 1; val == nullptr && i < nthreads * 2; i++) {
+                victim = (victim + 1) % nthreads;
+                if (victim != id) {
+                    val = deques[victim]->steal();
+                }
+            }
+            if (val == nullptr) {
+                // nothing left to steal: wait until all are idle, or for new work
+                idle.fetch_add(1);
+                while (true) {
+                    if (idle.load() == nthreads) {
+                        live += bytes;
+                        return;
+                    }
+                    auto work = std::any_of(deques.begin(), deques.end(),
+                                            [](auto &d) { return !d->empty(); });
+                    if (work) {
+                        idle.fetch_sub(1);
+                        break;
+                    }
+                    std::this_thread::yield();
+                }
+                continue;
+            }
+            if (!set_mark_atomic(val)) {
+                continue;
+            }
+            bytes += sizeof(heapval_t) + val->size * sizeof(int64_t);
+            trace_fields(val, [&deque](heapval_t *field) { deque.push(field); });
         }
+    };
+    std::vector<std::thread> threads;
+    for (size_t i = 1; i < nthreads; i++) {
+        threads.emplace_back(worker, i);
+    }
+    worker(0);
+    for (auto &t : threads) {
+        t.join();
     }
+    mem += live;
 }
 
+// Sweeping is lazy: the pages of the size classes are only queued, and `old_alloc` sweeps
+// them as it needs free cells. `mem` was recomputed by the marking, so the dead cells of
+// the queued pages are already accounted for. Large objects are freed right away.
 void sweep(void)
 {
     std::string msg = "sweep start " + std::to_string(mem);
     gc_log(msg);
-    for (auto it = heap.begin(); it != heap.end();) {
-        auto val = *it;
-        if (val->tag & MARKED_TAG) {
-            val->tag &= ~MARKED_TAG;
-            it++;
+    for (auto &sc : size_classes) {
+        sc.free_list = nullptr;
+        sc.unswept.insert(sc.unswept.end(), sc.pages.begin(), sc.pages.end());
+        sc.pages.clear();
+    }
+    size_t n = 0;
+    for (auto val : large_objects) {
+        if (is_marked(val)) {
+            auto bit = granule_of(val);
+            mark_bits[bit / 64] &= ~(1ULL << (bit % 64));
+            large_objects[n++] = val;
         }
         else {
-            it = heap.erase(it);
-            if (val->tag == VAL_ARRAY_TAG) {
-                val->tag &= ~VAL_ARRAY_TAG;
-                std::free(val->vtable);
-            }
-            mem -= sizeof(heapval_t) + val->size * sizeof(int64_t);
-            std::free(val);
+            free_pages(page_of(val));
         }
     }
+    large_objects.resize(n);
     msg = "sweep end " + std::to_string(mem);
     gc_log(msg);
 }
 
-void gc(void)
+// sweep the pages left by the last marking, before marking again
+void finish_sweep(void)
 {
-    queue_roots();
-    mark();
-    sweep();
+    for (auto &sc : size_classes) {
+        while (sweep_page(sc)) {
+        }
+    }
 }
 
+// Copy a young object to the old space, leaving a forwarding pointer behind. The fields
+// of the copy are updated later, when it is popped from the worklist.
+heapval_t *evacuate(heapval_t *val)
+{
+    if (!is_young(val)) {
+        return val;
+    }
+    if (val->tag & FORWARDED_TAG) {
+        return reinterpret_cast<heapval_t *>(reinterpret_cast<int64_t>(val->vtable) &
+                                             ~TAG_MASK);
+    }
+    size_t bytes = sizeof(heapval_t) + val->size * sizeof(int64_t);
+    auto copy = old_alloc(bytes);
+    std::memcpy(copy, val, bytes);
+    gc_stats.promoted_bytes += bytes;
+    val->vtable = reinterpret_cast<void *>(reinterpret_cast<int64_t>(copy) | FORWARDED_TAG);
+    worklist.push_back(copy);
+    return copy;
 }
 
-void *managed_alloc(size_t size)
+void evacuate_fields(heapval_t *val)
 {
-    if (mem + size > max_mem) {
-        gc::gc();
-        if (mem + size > max_mem) {
-            std::cerr << "Out of memory" << std::endl;
-            exit(1);
-        }
+    auto map = hval_ref_map(val);
+    for (int64_t i = 0; i < map->nrefs; i++) {
+        auto p = pith_field(val, map->refs[i]);
+        *p = reinterpret_cast<int64_t>(evacuate(reinterpret_cast<heapval_t *>(*p)));
     }
-    auto ptr = std::calloc(1, size);
-    if (ptr == NULL) {
-        std::cerr << "Out of memory" << std::endl;
-        exit(1);
+}
+
+// Promote all the live young objects. The roots are the reference slots of the frames and
+// the remembered set, all the survivors are copied to the old space so that the nursery
+// is empty afterwards.
+void minor(void)
+{
+    gc_log("minor");
+    for_each_root(
+        [](void **slot) { *slot = evacuate(reinterpret_cast<heapval_t *>(*slot)); });
+    for (auto val : remembered_set) {
+        auto bit = granule_of(val);
+        remembered_bits[bit / 64] &= ~(1ULL << (bit % 64));
+        evacuate_fields(val);
     }
-    mem += size;
-    return ptr;
-}
\ No newline at end of file
+    remembered_set.clear();
+    while (!worklist.empty()) {
+        auto val = worklist.back();
+        worklist.pop_back();
+        evacuate_fields(val);
+    }
+    nursery_top = nursery_start;
+}
+
+// Full collection: empty the nursery, then mark and sweep the old space
+void gc(void)
+{
+    minor();
+    finish_sweep();
+    mem = 0;
+    queue_roots();
+    if (gc_threads > 1) {
+        parallel_mark();
+    }
+    else {
+        mark();
+    }
+    sweep();
+}
+
+}
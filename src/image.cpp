@@ -0,0 +1,333 @@
+#include <cstring>
+#include <fstream>
+#include <unordered_map>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <bytecode.h>
+
+// ============================================================================
+// Bytecode images
+// ============================================================================
+
+namespace bc_compiler {
+
+using bytecode::instruction_t;
+using bytecode::op_code_t;
+
+// An image starts with its magic number and the version of its format, followed by
+// unsigned and signed LEB128 numbers: the table of the strings of the program, then the
+// classes and the methods, which only refer to strings by their index in the table. It
+// holds no address nor offset, so that it can be mapped anywhere.
+//
+//   strings:      count, then for each one its length and bytes
+//   classes:      count, then for each one
+//                 name, parent, fields (count, names), vtbl (count, class and method
+//                 names), ref_fields (count, indices), field_types (count, signed)
+//   methods:      count, then for each one
+//                 class and method names, args (count, names), locals (count, names),
+//                 local_refs (count, one byte each), local_types (count, signed),
+//                 return_type (signed), instructions (count, then op code and ref bytes,
+//                 followed by the three operands, signed)
+static const char image_magic[4] = {'M', 'V', 'M', 'I'};
+static const uint64_t image_version = 4;
+
+struct image_writer_t {
+    std::string out;
+    std::vector<std::string> strings;
+    std::unordered_map<std::string, uint64_t> string_index;
+    void uleb(uint64_t v)
+    {
+        do {
+            uint8_t byte = v & 0x7f;
+            v >>= 7;
+            out.push_back(static_cast<char>(byte | (v ? 0x80 : 0)));
+        } while (v);
+    }
+    void sleb(int64_t v)
+    {
+        bool more = true;
+        while (more) {
+            uint8_t byte = v & 0x7f;
+            v >>= 7; // arithmetic shift, keeps the sign
+            more = !((v == 0 && !(byte & 0x40)) || (v == -1 && (byte & 0x40)));
+            out.push_back(static_cast<char>(byte | (more ? 0x80 : 0)));
+        }
+    }
+    void string(const std::string &s)
+    {
+        auto it = string_index.find(s);
+        if (it == string_index.end()) {
+            it = string_index.emplace(s, strings.size()).first;
+            strings.push_back(s);
+        }
+        uleb(it->second);
+    }
+    void strings_of(const std::vector<std::string> &v)
+    {
+        uleb(v.size());
+        for (auto &s : v) {
+            string(s);
+        }
+    }
+};
+
+void write_image(const std::string &path, const std::vector<class_layout_t> &classes,
+                 const std::vector<method_layout_t> &methods)
+{
+    // the body refers to the strings, whose table goes before it
+    image_writer_t body;
+    body.uleb(classes.size());
+    for (auto &c : classes) {
+        body.string(c.name);
+        body.string(c.parent);
+        body.strings_of(c.fields);
+        body.uleb(c.vtbl.size());
+        for (auto &m : c.vtbl) {
+            body.string(m.first);
+            body.string(m.second);
+        }
+        body.uleb(c.ref_fields.size());
+        for (auto f : c.ref_fields) {
+            body.uleb(f);
+        }
+        body.uleb(c.field_types.size());
+        for (auto t : c.field_types) {
+            body.sleb(t);
+        }
+    }
+    body.uleb(methods.size());
+    for (auto &m : methods) {
+        body.string(m.method_name.first);
+        body.string(m.method_name.second);
+        body.strings_of(m.args);
+        body.strings_of(m.locals);
+        body.uleb(m.local_refs.size());
+        for (bool ref : m.local_refs) {
+            body.out.push_back(ref);
+        }
+        body.uleb(m.local_types.size());
+        for (auto t : m.local_types) {
+            body.sleb(t);
+        }
+        body.sleb(m.return_type);
+        body.uleb(m.instructions.size());
+        for (auto &i : m.instructions) {
+            body.out.push_back(static_cast<char>(i.op_code));
+            body.out.push_back(i.ref);
+            body.sleb(i.operand);
+            body.sleb(i.operand2);
+            body.sleb(i.operand3);
+        }
+    }
+    image_writer_t image;
+    image.out.append(image_magic, sizeof(image_magic));
+    image.uleb(image_version);
+    image.uleb(body.strings.size());
+    for (auto &s : body.strings) {
+        image.uleb(s.size());
+        image.out += s;
+    }
+    image.out += body.out;
+    std::ofstream file(path, std::ios::binary | std::ios::trunc);
+    file.write(image.out.data(), image.out.size());
+    if (!file) {
+        std::cerr << "error: cannot write image " << path << std::endl;
+        exit(1);
+    }
+}
+
+// Whether an instruction can be found in an image, which holds the program as compiled.
+// The other ones are introduced by the passes optimizing it once loaded from what they
+// prove about it, such as the array accesses without bounds check, which the verifier
+// cannot check.
+static bool is_compiled_op(uint8_t op_code)
+{
+    if (op_code > static_cast<uint8_t>(op_code_t::store_)) {
+        return false;
+    }
+    switch (static_cast<op_code_t>(op_code)) {
+    case op_code_t::guard_class_:
+    case op_code_t::iaload_nc_:
+    case op_code_t::iastore_nc_:
+    case op_code_t::invoke_direct_:
+    case op_code_t::load_getfield_:
+    case op_code_t::load_ldc_iadd_:
+    case op_code_t::load_ldc_isub_:
+    case op_code_t::load_load_:
+    case op_code_t::load_load_if_ige_: return false;
+    default: return true;
+    }
+}
+
+// Reads the numbers of an image mapped in memory, exiting on those running past its end
+struct image_reader_t {
+    const uint8_t *p;
+    const uint8_t *end;
+    std::vector<std::string> strings;
+    uint8_t byte()
+    {
+        if (p == end) {
+            std::cerr << "error: truncated image" << std::endl;
+            exit(1);
+        }
+        return *p++;
+    }
+    bool flag()
+    {
+        auto b = byte();
+        if (b > 1) {
+            std::cerr << "error: bad flag in image" << std::endl;
+            exit(1);
+        }
+        return b;
+    }
+    uint64_t uleb()
+    {
+        uint64_t v = 0;
+        for (unsigned shift = 0;; shift += 7) {
+            uint8_t b = byte();
+            if (shift < 64) {
+                v |= static_cast<uint64_t>(b & 0x7f) << shift;
+            }
+            if (!(b & 0x80)) {
+                return v;
+            }
+        }
+    }
+    int64_t sleb()
+    {
+        uint64_t v = 0;
+        unsigned shift = 0;
+        uint8_t b;
+        do {
+            b = byte();
+            if (shift < 64) {
+                v |= static_cast<uint64_t>(b & 0x7f) << shift;
+            }
+            shift += 7;
+        } while (b & 0x80);
+        if (shift < 64 && (b & 0x40)) {
+            v |= ~static_cast<uint64_t>(0) << shift;
+        }
+        return static_cast<int64_t>(v);
+    }
+    // a count, which cannot exceed the bytes left since every element takes one or more
+    size_t count()
+    {
+        auto n = uleb();
+        if (n > static_cast<uint64_t>(end - p)) {
+            std::cerr << "error: truncated image" << std::endl;
+            exit(1);
+        }
+        return n;
+    }
+    const std::string &string()
+    {
+        auto s = uleb();
+        if (s >= strings.size()) {
+            std::cerr << "error: bad string in image" << std::endl;
+            exit(1);
+        }
+        return strings[s];
+    }
+    std::vector<std::string> strings_of()
+    {
+        std::vector<std::string> v(count());
+        for (auto &s : v) {
+            s = string();
+        }
+        return v;
+    }
+};
+
+bool load_image(int fd, std::vector<class_layout_t> &classes,
+                std::vector<method_layout_t> &methods)
+{
+    struct stat st;
+    if (fstat(fd, &st) == -1 || st.st_size < static_cast<off_t>(sizeof(image_magic))) {
+        return false;
+    }
+    void *map = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED) {
+        return false;
+    }
+    auto start = static_cast<const uint8_t *>(map);
+    if (std::memcmp(start, image_magic, sizeof(image_magic)) != 0) {
+        munmap(map, st.st_size);
+        return false;
+    }
+    image_reader_t r{start + sizeof(image_magic), start + st.st_size, {}};
+    auto version = r.uleb();
+    if (version != image_version) {
+        std::cerr << "error: image version " << version << ", expected " << image_version
+                  << std::endl;
+        exit(1);
+    }
+    r.strings.resize(r.count());
+    for (auto &s : r.strings) {
+        auto size = r.count();
+        s.assign(reinterpret_cast<const char *>(r.p), size);
+        r.p += size;
+    }
+    classes.resize(r.count());
+    for (auto &c : classes) {
+        c.name = r.string();
+        c.parent = r.string();
+        c.fields = r.strings_of();
+        c.vtbl.resize(r.count());
+        for (auto &m : c.vtbl) {
+            m.first = r.string();
+            m.second = r.string();
+        }
+        c.ref_fields.resize(r.count());
+        for (auto &f : c.ref_fields) {
+            f = r.uleb();
+        }
+        c.field_types.resize(r.count());
+        for (auto &t : c.field_types) {
+            t = r.sleb();
+        }
+    }
+    methods.resize(r.count());
+    for (auto &m : methods) {
+        m.method_name.first = r.string();
+        m.method_name.second = r.string();
+        m.args = r.strings_of();
+        m.locals = r.strings_of();
+        m.local_refs.resize(r.count());
+        for (size_t l = 0; l < m.local_refs.size(); ++l) {
+            m.local_refs[l] = r.flag();
+        }
+        m.local_types.resize(r.count());
+        for (auto &t : m.local_types) {
+            t = r.sleb();
+        }
+        m.return_type = r.sleb();
+        auto n = r.count();
+        m.instructions.reserve(n);
+        for (size_t k = 0; k < n; ++k) {
+            auto op_code = r.byte();
+            if (!is_compiled_op(op_code)) {
+                std::cerr << "error: bad op code in image" << std::endl;
+                exit(1);
+            }
+            bool ref = r.flag();
+            auto operand = r.sleb();
+            auto operand2 = r.sleb();
+            auto operand3 = r.sleb();
+            m.instructions.emplace_back(static_cast<op_code_t>(op_code), operand, operand2,
+                                        operand3, ref);
+        }
+    }
+    if (r.p != r.end) {
+        std::cerr << "error: trailing data in image" << std::endl;
+        exit(1);
+    }
+    munmap(map, st.st_size);
+    return true;
+}
+
+} // namespace bc_compiler
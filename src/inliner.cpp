@@ -0,0 +1,219 @@
+#include <algorithm>
+#include <set>
+#include <unordered_map>
+
+#include <bytecode.h>
+
+// ============================================================================
+// Inliner
+// ============================================================================
+
+namespace bc_compiler {
+
+using bytecode::instruction_t;
+using bytecode::op_code_t;
+
+// Class hierarchy analysis: the methods an invoke_ can call are those of its slot of the
+// vtables of the static class of its receiver and of its subclasses
+struct class_hierarchy_t {
+    const std::vector<class_layout_t> &classes;
+    const std::vector<method_layout_t> &methods;
+    class_hierarchy_t(const std::vector<class_layout_t> &classes,
+                      const std::vector<method_layout_t> &methods)
+      : classes(classes), methods(methods)
+    {
+    }
+    long method_index(const std::pair<std::string, std::string> &name)
+    {
+        auto m = std::find_if(
+            methods.begin(), methods.end(),
+            [&name](const method_layout_t &m) { return m.method_name == name; });
+        return std::distance(methods.begin(), m);
+    }
+    bool is_subclass(long c, long ancestor)
+    {
+        return classes[ancestor].interval.contains(classes[c].interval);
+    }
+    std::set<long> targets(const instruction_t &invoke)
+    {
+        std::set<long> targets;
+        for (size_t c = 0; c < classes.size(); ++c) {
+            if (is_subclass(c, invoke.operand3)) {
+                targets.insert(method_index(classes[c].vtbl.at(invoke.operand)));
+            }
+        }
+        return targets;
+    }
+};
+
+struct inliner_t {
+    const std::vector<class_layout_t> &classes;
+    std::vector<method_layout_t> &methods;
+    size_t budget;
+    inline_stats_t &stats;
+    class_hierarchy_t hierarchy;
+    // code of the methods before inlining
+    std::vector<std::vector<instruction_t>> bodies;
+    inliner_t(const std::vector<class_layout_t> &classes,
+              std::vector<method_layout_t> &methods, size_t budget, inline_stats_t &stats)
+      : classes(classes), methods(methods), budget(budget), stats(stats),
+        hierarchy(classes, methods)
+    {
+        for (auto &m : methods) {
+            bodies.push_back(m.instructions);
+        }
+    }
+    bool is_inlinable(long m);
+    void inline_calls(method_layout_t &method);
+};
+
+// small leaf methods, so that inlining never recurses
+bool inliner_t::is_inlinable(long m)
+{
+    auto &body = bodies[m];
+    return body.size() <= budget && methods[m].method_name.second != "main" &&
+           std::none_of(body.begin(), body.end(), [](const instruction_t &i) {
+               return i.op_code == op_code_t::invoke_;
+           });
+}
+
+// The receiver and the arguments of an inlined call are stored into locals of the caller
+// standing for the slots of the callee frame, the locals of the callee are cleared and its
+// body follows, with its locals renamed and its `return` branching past its end, leaving
+// the returned value on the operand stack as the call would. Inlined calls share these
+// locals, only taking care not to mix ints and references, which the stack maps rely on.
+// A call with several possible targets inlines the method of the static class of the
+// receiver behind a guard_class_, which falls back to the call for the other classes.
+void inliner_t::inline_calls(method_layout_t &method)
+{
+    auto old = std::move(method.instructions);
+    auto &code = method.instructions;
+    code.clear();
+    // new pc of each instruction of the method, and the branches to relocate accordingly
+    std::vector<size_t> new_pc(old.size() + 1);
+    std::vector<size_t> branches;
+    std::vector<long> pools[2]; // locals holding ints and references for inlined calls
+    for (size_t pc = 0; pc < old.size(); ++pc) {
+        new_pc[pc] = code.size();
+        auto &i = old[pc];
+        if (i.op_code != op_code_t::invoke_) {
+            if (i.is_branch()) {
+                branches.push_back(code.size());
+            }
+            code.push_back(i);
+            continue;
+        }
+        stats.call_sites++;
+        auto receiver_class = i.operand3;
+        auto candidates = hierarchy.targets(i);
+        auto guarded = candidates.size() > 1;
+        auto callee = *candidates.begin();
+        if (guarded) {
+            callee = hierarchy.method_index(classes[receiver_class].vtbl.at(i.operand));
+        }
+        if (!is_inlinable(callee)) {
+            code.push_back(i);
+            continue;
+        }
+        stats.inlined++;
+        stats.guarded += guarded ? 1 : 0;
+        auto &refs = methods[callee].local_refs;
+        std::vector<long> slots;
+        size_t used[2] = {0, 0};
+        for (bool ref : refs) {
+            auto &pool = pools[ref];
+            if (used[ref] == pool.size()) {
+                pool.push_back(method.local_refs.size());
+                method.locals.push_back((ref ? "inlined_ref_" : "inlined_int_") +
+                                        std::to_string(pool.size() - 1));
+                method.local_refs.push_back(ref);
+                method.local_types.push_back(ref ? type_any_ref : type_int);
+            }
+            slots.push_back(pool[used[ref]++]);
+        }
+        long nargs = i.operand2;
+        for (auto k = nargs; k-- > 0;) {
+            code.push_back(instruction_t{op_code_t::store_, slots[k]});
+        }
+        for (auto k = nargs; k < static_cast<long>(slots.size()); ++k) {
+            code.push_back(instruction_t{op_code_t::ldc_, 0});
+            code.push_back(instruction_t{op_code_t::store_, slots[k]});
+        }
+        auto guard = code.size();
+        if (guarded) {
+            code.push_back(
+                instruction_t{op_code_t::guard_class_, 0, slots[0], receiver_class});
+        }
+        // the final return is dropped, a return elsewhere goes to where it was
+        auto &body = bodies[callee];
+        auto base = static_cast<long>(code.size());
+        auto end = base + static_cast<long>(body.size()) - 1;
+        for (size_t j = 0; j + 1 < body.size(); ++j) {
+            auto inlined = body[j];
+            if (inlined.is_branch()) {
+                inlined.operand += base;
+            }
+            switch (inlined.op_code) {
+            case op_code_t::load_:
+            case op_code_t::store_: inlined.operand = slots[inlined.operand]; break;
+            case op_code_t::if_false_:
+            case op_code_t::if_true_: inlined.operand2 = slots[inlined.operand2]; break;
+            case op_code_t::return_: inlined = instruction_t{op_code_t::goto_, end}; break;
+            default: break;
+            }
+            code.push_back(inlined);
+        }
+        if (guarded) {
+            // the call itself for the other classes
+            auto skip = code.size();
+            code.push_back(instruction_t{op_code_t::goto_, 0});
+            code[guard].operand = code.size();
+            for (long k = 0; k < nargs; ++k) {
+                code.push_back(instruction_t{op_code_t::load_, slots[k]});
+            }
+            code.push_back(i);
+            code[skip].operand = code.size();
+        }
+    }
+    new_pc[old.size()] = code.size();
+    for (auto b : branches) {
+        code[b].operand = new_pc[code[b].operand];
+    }
+}
+
+// Calls are inlined using class hierarchy analysis. A call with a single possible
+// target, a small method calling no other method, is replaced by the body of that method,
+// saving the frame push and pop of the call and its dispatches.
+void inline_methods(const std::vector<class_layout_t> &classes,
+                    std::vector<method_layout_t> &methods, size_t budget,
+                    inline_stats_t &stats)
+{
+    inliner_t inliner{classes, methods, budget, stats};
+    for (auto &method : methods) {
+        inliner.inline_calls(method);
+    }
+}
+
+// A call which can only reach one method, because no subclass of the static class of its
+// receiver overrides it, does not need the vtable of the receiver: invoke_direct_ pushes
+// the frame of that method right away, skipping the inline cache lookup.
+void devirtualize(const std::vector<class_layout_t> &classes,
+                  std::vector<method_layout_t> &methods, inline_stats_t &stats)
+{
+    class_hierarchy_t hierarchy{classes, methods};
+    for (auto &method : methods) {
+        for (auto &i : method.instructions) {
+            if (i.op_code != op_code_t::invoke_) {
+                continue;
+            }
+            auto candidates = hierarchy.targets(i);
+            if (candidates.size() == 1) {
+                stats.direct++;
+                i = instruction_t{op_code_t::invoke_direct_, *candidates.begin(), i.operand2,
+                                  i.operand3, i.ref};
+            }
+        }
+    }
+}
+
+} // namespace bc_compiler
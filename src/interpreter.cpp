@@ -1,10 +1,13 @@
+#include <algorithm>
+#include <cstring>
+
+#include <unordered_map>
+
 #include <fcntl.h>
 #include <unistd.h>
 
 #include <bytecode.h>
-
-vector_t frames;
-frame_t *fp;
+#include <jit.h>
 
 // ============================================================================
 // Interpreter
@@ -12,20 +15,46 @@ frame_t *fp;
 
 namespace interpreter {
 
+// the operands of the encoded instructions
+using bytecode::cache_of;
+using bytecode::class_of;
+using bytecode::constant2_of;
+using bytecode::constant_of;
+using bytecode::index2_of;
+using bytecode::index_of;
+using bytecode::local_of;
+using bytecode::nargs_of;
+using bytecode::op_of;
+using bytecode::target_of;
+
 // enum class op_code_t {
 //     band_, // bitwise and
 //     bneg_, // bitwise negation
 //     getfield_, // get a field value of an object objectref
 //     goto_, // goes to another instruction at branchoffset
 //     goto_if_false_, // if value is false (0), goes to another instruction at branchoffset
+//     guard_class_, // if local #operand2 is not of class #operand3, goes to branchoffset
 //     iadd_, // add two ints
 //     iaload_, // load an int from an array
+//     iaload_nc_, // iaload_ without bounds check, the index is known to be in bounds
 //     iastore_, // store an int into an array
+//     iastore_nc_, // iastore_ without bounds check, the index is known to be in bounds
+//     if_false_, // if local #operand2 is false (0), goes to the instruction at branchoffset
+//     if_ige_, // if value1 >= value2, goes to another instruction at branchoffset
+//     if_ilt_, // if value1 < value2, goes to another instruction at branchoffset
+//     if_true_, // if local #operand2 is true (1), goes to the instruction at branchoffset
 //     ilt_, // less than
 //     imul_, // multiply two integers
 //     invoke_, // invoke instance method on object objectref and puts result on the stack
+//     invoke_direct_, // invoke_ of method #operand, the only one the call can reach from
+//                     // receivers of class #operand3 and its subclasses
 //     isub_, // subtract two integers
 //     load_, // load a reference onto the stack from a local variable #index
+//     load_getfield_, // superinstruction: load_ operand; getfield_ operand2
+//     load_ldc_iadd_, // superinstruction: load_ operand; ldc_ operand2; iadd_
+//     load_ldc_isub_, // superinstruction: load_ operand; ldc_ operand2; isub_
+//     load_load_, // superinstruction: load_ operand; load_ operand2
+//     load_load_if_ige_, // superinstruction: load_ operand; load_ operand2; if_ige_
 //     ldc_, // push a constant onto the stack
 //     length_, // array length
 //     new_, // create new object of type identified by class reference
@@ -36,32 +65,175 @@ namespace interpreter {
 //     store_, // store value into variable
 // };
 
+// computed goto (labels as values) is a GNU extension
+#if defined(__GNUC__)
+#define HAVE_COMPUTED_GOTO
+#endif
+
+enum class engine_t {
+    switch_loop, // portable switch based dispatch
+    threaded, // direct threaded dispatch through computed gotos
+    register_, // register bytecode, see `bc_compiler::compile_registers`
+    jit, // switch loop compiling the hot methods to native code, see jit.cpp
+};
+
+// A resolved call target, with what is needed to push its frame
+struct ic_entry_t {
+    void *vtable; // receiver class
+    void *ip_start;
+    size_t nlocals; // locals, or registers past the arguments for the register engine
+    size_t max_stack;
+};
+
+// Polymorphic inline cache of an invoke_ call site, keyed on the vtable of the receiver.
+// Once all entries are taken, the site is megamorphic and misses go through the vtable.
+#define IC_ENTRIES 4
+struct inline_cache_t {
+    size_t size = 0;
+    bool megamorphic = false;
+    ic_entry_t entries[IC_ENTRIES];
+};
+
+struct stats_t {
+    size_t ic_hits = 0;
+    size_t ic_misses = 0;
+    size_t jit_compiled = 0;
+    size_t jit_osr = 0; // interpreted frames continued in native code from a back edge
+};
+
+// A method is compiled once it has been called or has taken a back edge `jit_threshold`
+// times in the interpreter
+struct jit_method_t {
+    size_t counter = 0;
+    bool failed = false;
+    jit::compiled_method_t compiled;
+};
+
+// native code entered from native code, each nesting using the C stack, which is much
+// smaller than the VM stack: the deeper frames are interpreted
+#define JIT_MAX_DEPTH 4096
+
+#define NUM_OP_CODES (static_cast<size_t>(bytecode::op_code_t::store_) + 1)
+
+// bytes a superinstruction steps over: its own and those of the instructions it stands
+// for, kept after it but for the first load_, which it replaces
+constexpr size_t fused_size(bytecode::op_code_t op_code)
+{
+    using bytecode::encoded_size;
+    using bytecode::op_code_t;
+    switch (op_code) {
+    case op_code_t::load_getfield_:
+        return encoded_size(op_code) + encoded_size(op_code_t::getfield_);
+    case op_code_t::load_ldc_iadd_:
+    case op_code_t::load_ldc_isub_:
+        return encoded_size(op_code) + encoded_size(op_code_t::ldc_) + 1;
+    case op_code_t::load_load_:
+        return encoded_size(op_code) + encoded_size(op_code_t::load_);
+    case op_code_t::load_load_if_ige_:
+        return encoded_size(op_code) + encoded_size(op_code_t::load_) +
+               encoded_size(op_code_t::if_ige_);
+    default: return encoded_size(op_code);
+    }
+}
+
+// branch target of a load_load_if_ige_, read from the if_ige_ kept after it
+static inline uint32_t if_ige_target(const uint8_t *ip)
+{
+    using bytecode::op_code_t;
+    return target_of(ip + bytecode::encoded_size(op_code_t::load_load_if_ige_) +
+                     bytecode::encoded_size(op_code_t::load_));
+}
+
+// Dynamic counts of the sequences of 2 and 3 adjacent instructions of a method executed one
+// after the other, the candidates for superinstructions, see `--profile-sequences`
+struct sequence_profile_t {
+    size_t executed = 0;
+    std::vector<size_t> pairs = std::vector<size_t>(NUM_OP_CODES * NUM_OP_CODES);
+    std::vector<size_t> triples =
+        std::vector<size_t>(NUM_OP_CODES * NUM_OP_CODES * NUM_OP_CODES);
+};
+
 struct interpreter_t {
     std::vector<bc_compiler::class_layout_t> classes;
     std::vector<bc_compiler::method_layout_t> methods;
+    engine_t engine = engine_t::switch_loop;
+    bool print_stats = false;
+    stats_t stats;
+    bc_compiler::inline_stats_t inline_stats;
+    bool profile_sequences = false;
+    sequence_profile_t profile;
+    // one per invoke_ instruction, indexed by its `operand3` (or `d`)
+    std::vector<inline_cache_t> inline_caches;
+    // descriptors of the classes, each followed by its vtable and its reference map
+    std::vector<uint64_t> class_arena;
+    // stack maps of the methods, registered with the collector
+    std::vector<std::vector<ref_map_t>> stack_maps;
+    ic_entry_t ic_miss; // target of the last miss at a megamorphic site
+    size_t jit_threshold = 1000;
+    std::vector<jit_method_t> jit_methods;
+    jit::runtime_t jit_runtime;
+    // index of each method, by its first instruction
+    std::unordered_map<void *, size_t> method_index;
+    size_t native_depth = 0;
     interpreter_t(std::vector<bc_compiler::class_layout_t> classes,
                   std::vector<bc_compiler::method_layout_t> methods)
       : classes{std::move(classes)}, methods{std::move(methods)}
     {
-        vector_init(&frames, 16);
+        vm_stack_init();
+        heap_init();
     }
     void exec(void);
+    void layout_classes(void);
+    void dispatch(uint8_t *ip);
     void loop(void);
+    void loop_profile(void);
+    void loop_threaded(void);
+    void loop_register(void);
+    void loop_jit(frame_t *base);
+    jit::code_t jit_code(size_t m);
+    bool jit_call(void);
+    void jit_run(jit::code_t code, void *entry);
     void log(const char *msg);
+    void finish(void);
+    void report_sequences(void);
+    ic_entry_t *ic_resolve(inline_cache_t &ic, void *vtable, long method_idx);
+    ic_entry_t *ic_lookup(inline_cache_t &ic, void *vtable, long method_idx)
+    {
+        for (size_t i = 0; i < ic.size; ++i) {
+            if (ic.entries[i].vtable == vtable) {
+                stats.ic_hits++;
+                return &ic.entries[i];
+            }
+        }
+        return ic_resolve(ic, vtable, method_idx);
+    }
     void exec_band(void);
     void exec_bneg(void);
     void exec_dup(void);
     void exec_getfield(void);
     void exec_goto(void);
     void exec_goto_if_false(void);
+    void exec_guard_class(void);
     void exec_iadd(void);
     void exec_iaload(void);
+    void exec_iaload_nc(void);
     void exec_iastore(void);
+    void exec_iastore_nc(void);
+    void exec_if_false(void);
+    void exec_if_ige(void);
+    void exec_if_ilt(void);
+    void exec_if_true(void);
     void exec_ilt(void);
     void exec_imul(void);
     void exec_invoke(void);
+    void exec_invoke_direct(void);
     void exec_isub(void);
     void exec_load(void);
+    void exec_load_getfield(void);
+    void exec_load_ldc_iadd(void);
+    void exec_load_ldc_isub(void);
+    void exec_load_load(void);
+    void exec_load_load_if_ige(void);
     void exec_ldc(void);
     void exec_length(void);
     void exec_new(void);
@@ -70,6 +242,9 @@ struct interpreter_t {
     void exec_print(void);
     void exec_return(void);
     void exec_store(void);
+    void exec_reg_invoke(void);
+    void exec_reg_invoke_direct(void);
+    void exec_reg_return(void);
 };
 
 // #define ENABLE_LOGGING
@@ -81,58 +256,847 @@ void interpreter_t::log(const char *msg)
 #endif
 }
 
-void interpreter_t::exec(void)
+// print the statistics requested with `--stats` and terminate
+void interpreter_t::finish(void)
 {
-    log("exec");
-    // fix up vtables
+    std::cout << std::flush;
+    if (profile_sequences) {
+        report_sequences();
+    }
+    if (print_stats) {
+        size_t sites[3] = {0, 0, 0}; // monomorphic, polymorphic, megamorphic
+        for (auto &ic : inline_caches) {
+            if (ic.megamorphic) {
+                sites[2]++;
+            }
+            else if (ic.size > 1) {
+                sites[1]++;
+            }
+            else if (ic.size == 1) {
+                sites[0]++;
+            }
+        }
+        auto lookups = stats.ic_hits + stats.ic_misses;
+        fprintf(stderr,
+                "inline caches: %zu sites (%zu monomorphic, %zu polymorphic, %zu "
+                "megamorphic), %zu hits, %zu misses, %.2f%% hit rate\n",
+                inline_caches.size(), sites[0], sites[1], sites[2], stats.ic_hits,
+                stats.ic_misses, lookups ? 100.0 * stats.ic_hits / lookups : 0.0);
+        fprintf(stderr,
+                "inlining: %zu of %zu call sites inlined (%zu guarded), %zu calls direct\n",
+                inline_stats.inlined, inline_stats.call_sites, inline_stats.guarded,
+                inline_stats.direct);
+        if (engine == engine_t::jit) {
+            fprintf(stderr, "jit: %zu methods compiled, %zu on-stack replacements\n",
+                    stats.jit_compiled, stats.jit_osr);
+        }
+        if (engine != engine_t::register_) {
+            size_t ninstructions = 0, nbytes = 0;
+            for (auto &m : methods) {
+                ninstructions += m.instructions.size();
+                nbytes += m.code.size();
+            }
+            fprintf(stderr, "code: %zu instructions, %zu bytes encoded (%zu unencoded)\n",
+                    ninstructions, nbytes, ninstructions * sizeof(bytecode::instruction_t));
+        }
+        auto pauses = [](const char *kind, pause_stats_t &p) {
+            fprintf(stderr, "gc: %zu %s collections, pauses %.2fms total, %.2fms max\n",
+                    p.count, kind, p.total_ms, p.max_ms);
+        };
+        pauses("minor", gc_stats.minor);
+        pauses("major", gc_stats.major);
+        fprintf(stderr, "gc: %zu bytes promoted, %zu pages swept lazily\n",
+                gc_stats.promoted_bytes, gc_stats.lazily_swept_pages);
+    }
+    exit(0);
+}
+
+// print the most executed sequences of the profile
+void interpreter_t::report_sequences(void)
+{
+    auto name = [](size_t op) {
+        auto s = bytecode::instruction_t{static_cast<bytecode::op_code_t>(op)}.as_str();
+        return s.substr(0, s.find(' '));
+    };
+    auto report = [&](const char *kind, std::vector<size_t> &counts, size_t length) {
+        std::vector<size_t> order(counts.size());
+        for (size_t k = 0; k < order.size(); ++k) {
+            order[k] = k;
+        }
+        std::sort(order.begin(), order.end(),
+                  [&counts](size_t a, size_t b) { return counts[a] > counts[b]; });
+        for (size_t k = 0; k < 10 && counts[order[k]] > 0; ++k) {
+            std::string seq;
+            for (size_t i = 0, ops = order[k]; i < length; ++i, ops /= NUM_OP_CODES) {
+                seq = name(ops % NUM_OP_CODES) + (i == 0 ? "" : " ") + seq;
+            }
+            fprintf(stderr, "  %-7s %-36s %12zu %6.2f%%\n", kind, seq.c_str(),
+                    counts[order[k]], 100.0 * counts[order[k]] / profile.executed);
+        }
+    };
+    fprintf(stderr, "sequences: %zu instructions executed\n", profile.executed);
+    report("pair", profile.pairs, 2);
+    report("triple", profile.triples, 3);
+}
+
+ic_entry_t *interpreter_t::ic_resolve(inline_cache_t &ic, void *vtable, long method_idx)
+{
+    stats.ic_misses++;
+    auto &method = reinterpret_cast<class_info_t *>(vtable)->methods[method_idx];
+    ic_entry_t entry;
+    entry.vtable = vtable;
+    entry.ip_start = method.code;
+    entry.nlocals = method.nlocals;
+    entry.max_stack = method.max_stack;
+    if (ic.size == IC_ENTRIES) {
+        ic.megamorphic = true;
+        ic_miss = entry;
+        return &ic_miss;
+    }
+    ic.entries[ic.size] = entry;
+    return &ic.entries[ic.size++];
+}
+
+#ifdef HAVE_JIT
+
+// runs an instruction left to the interpreter by native code
+static void jit_exec(void *context, uint8_t *ip, void **sp)
+{
+    fp->ip = reinterpret_cast<void *>(ip);
+    fp->sp = sp;
+    static_cast<interpreter_t *>(context)->dispatch(ip);
+}
+
+// runs a call of native code until the callee has returned
+static void jit_invoke(void *context, uint8_t *ip, void **sp)
+{
+    auto interpreter = static_cast<interpreter_t *>(context);
+    fp->ip = reinterpret_cast<void *>(ip);
+    fp->sp = sp;
+    auto caller = fp;
+    if (!interpreter->jit_call()) {
+        interpreter->loop_jit(caller);
+    }
+}
+
+// `loop` of the jit engine, running the frames above `base` until they have returned:
+// calls to compiled methods run in native code, as the interpreted frames of a compiled
+// method from their next back edge on
+void interpreter_t::loop_jit(frame_t *base)
+{
+    while (fp > base) {
+        log("loop_jit");
+        auto ip = static_cast<uint8_t *>(fp->ip);
+        auto i = bytecode::instruction_t{op_of(ip)};
+        if (i.is_call()) {
+            jit_call();
+            continue;
+        }
+        dispatch(ip);
+        auto target = static_cast<uint8_t *>(fp->ip);
+        if (i.is_branch() && target <= ip) {
+            auto m = method_index.at(fp->ip_start);
+            auto code = jit_code(m);
+            if (code != nullptr && native_depth < JIT_MAX_DEPTH) {
+                stats.jit_osr++;
+                auto ip_start = static_cast<uint8_t *>(fp->ip_start);
+                jit_run(code, jit_methods[m].compiled.entries[target - ip_start]);
+            }
+        }
+    }
+}
+
+// the native code of method #m, compiled when the method crosses the threshold, or null
+jit::code_t interpreter_t::jit_code(size_t m)
+{
+    auto &state = jit_methods[m];
+    if (state.compiled.code == nullptr && !state.failed &&
+        state.counter++ >= jit_threshold) {
+        // `main` only runs once, and its return ends the program
+        state.failed = m == 0 || !jit::compile(methods[m], jit_runtime, state.compiled);
+        stats.jit_compiled += state.failed ? 0 : 1;
+    }
+    return state.compiled.code;
+}
+
+// Pushes the frame of the method called by the call `fp` is on and runs it in native code
+// until it returns if the method is compiled. Returns false if the frame is left to the
+// interpreter.
+bool interpreter_t::jit_call(void)
+{
+    auto ip = static_cast<uint8_t *>(fp->ip);
+    auto nargs = nargs_of(ip);
+    auto args = fp->sp - nargs;
+    bc_compiler::method_layout_t *method;
+    if (op_of(ip) == bytecode::op_code_t::invoke_direct_) {
+        method = &methods[index_of(ip)];
+    }
+    else {
+        auto info = reinterpret_cast<class_info_t *>(hval_vtable(ptr_to_hval(args[0])));
+        method = &methods[info->methods[index_of(ip)].method];
+    }
+    fp->sp = args;
+    auto frame = frame_push(args, nargs, method->locals.size(), method->max_stack);
+    frame->ip = frame->ip_start = method->code.data();
+    auto code = jit_code(method - methods.data());
+    if (code == nullptr || native_depth == JIT_MAX_DEPTH) {
+        return false;
+    }
+    jit_run(code, jit_methods[method - methods.data()].compiled.entries[0]);
+    return true;
+}
+
+void interpreter_t::jit_run(jit::code_t code, void *entry)
+{
+    native_depth++;
+    code(fp->locals, this, entry);
+    native_depth--;
+}
+
+#endif // HAVE_JIT
+
+// Lays out the descriptors of the classes one after the other in `class_arena`, which is
+// not resized afterwards since objects point to them. The vtable slots are resolved to the
+// code run by the engine through a table of the methods by name.
+void interpreter_t::layout_classes(void)
+{
+    std::unordered_map<std::string, size_t> method_by_name;
+    for (size_t m = 0; m < methods.size(); ++m) {
+        auto &name = methods[m].method_name;
+        method_by_name.emplace(name.first + "." + name.second, m);
+    }
+    auto words = [](size_t bytes) { return (bytes + 7) / 8; };
+    auto size_of = [&](const bc_compiler::class_layout_t &c) {
+        return words(sizeof(class_info_t) + c.vtbl.size() * sizeof(method_entry_t)) +
+               words(c.ref_fields.size() * sizeof(int32_t));
+    };
+    size_t size = 0;
     for (auto &c : classes) {
-        for (auto &mpair : c.vtbl) {
-            auto m = std::find_if(methods.begin(), methods.end(),
-                                  [&mpair](const bc_compiler::method_layout_t &m) {
-                                      return m.method_name == mpair;
-                                  });
-            if (m == methods.end()) {
-                std::cerr << "method not found: " << mpair.second << std::endl;
+        size += size_of(c);
+    }
+    class_arena.assign(size, 0);
+    auto p = class_arena.data();
+    for (size_t k = 0; k < classes.size(); ++k) {
+        auto &c = classes[k];
+        auto info = reinterpret_cast<class_info_t *>(p);
+        info->id = k;
+        info->preorder = c.interval.preorder;
+        info->last_descendant = c.interval.last_descendant;
+        info->nfields = c.fields.size();
+        info->nmethods = c.vtbl.size();
+        for (size_t slot = 0; slot < c.vtbl.size(); ++slot) {
+            auto &name = c.vtbl[slot];
+            auto it = method_by_name.find(name.first + "." + name.second);
+            if (it == method_by_name.end()) {
+                std::cerr << "method not found: " << name.second << std::endl;
                 exit(1);
             }
-            c.vtable.push_back(&(*m));
+            auto &method = methods[it->second];
+            auto &entry = info->methods[slot];
+            entry.method = it->second;
+            if (engine == engine_t::register_) {
+                entry.code = reinterpret_cast<void *>(&method.reg_instructions[0]);
+                entry.nlocals = method.nregs - 1 - method.args.size();
+                entry.max_stack = 0;
+            }
+            else {
+                entry.code = method.code.data();
+                entry.nlocals = method.locals.size();
+                entry.max_stack = method.max_stack;
+            }
+        }
+        auto refs = reinterpret_cast<int32_t *>(&info->methods[c.vtbl.size()]);
+        std::copy(c.ref_fields.begin(), c.ref_fields.end(), refs);
+        info->ref_map = ref_map_t{static_cast<int64_t>(c.ref_fields.size()), refs};
+        c.info = info;
+        p += size_of(c);
+    }
+}
+
+void interpreter_t::exec(void)
+{
+    log("exec");
+    // give every call site of the bytecode which runs its inline cache
+    size_t ncall_sites = 0;
+    for (auto &m : methods) {
+        if (engine == engine_t::register_) {
+            for (auto &i : m.reg_instructions) {
+                if (i.op_code == bytecode::reg_op_code_t::invoke_) {
+                    i.d = ncall_sites++;
+                }
+            }
+            continue;
+        }
+        for (auto &i : m.instructions) {
+            if (i.op_code == bytecode::op_code_t::invoke_) {
+                i.operand3 = ncall_sites++;
+            }
+        }
+        bc_compiler::encode(m);
+    }
+    inline_caches.resize(ncall_sites);
+    layout_classes();
+    // register the stack maps of the code run by the engine, by byte offset for the
+    // encoded instructions
+    for (auto &m : methods) {
+        stack_maps.emplace_back();
+        auto &maps = stack_maps.back();
+        if (engine == engine_t::register_) {
+            for (auto &map : m.reg_stack_maps) {
+                maps.push_back(ref_map_t{static_cast<int64_t>(map.size()), map.data()});
+            }
+            register_stack_maps(&m.reg_instructions[0], sizeof(bytecode::reg_instruction_t),
+                                maps.data());
+            continue;
+        }
+        maps.resize(m.code.size());
+        for (size_t pc = 0; pc < m.stack_maps.size(); ++pc) {
+            auto &map = m.stack_maps[pc];
+            maps[m.code_offsets[pc]] =
+                ref_map_t{static_cast<int64_t>(map.size()), map.data()};
         }
+        register_stack_maps(m.code.data(), 1, maps.data());
     }
-    auto frame = frame_create();
-    frame->ip = frame->ip_start = reinterpret_cast<void *>(&methods[0].instructions[0]);
     assert(std::strcmp(methods[0].method_name.second.c_str(), "main") == 0);
-    vector_push(&frames, frame);
-    fp = frame;
+    if (engine == engine_t::register_) {
+        auto frame = frame_push(fp->sp, 0, methods[0].nregs, 0);
+        frame->ip = frame->ip_start =
+            reinterpret_cast<void *>(&methods[0].reg_instructions[0]);
+        loop_register();
+    }
+    // `main` has an empty slot for `this`, as the other methods, followed by the locals of
+    // the calls inlined into it
+    auto frame = frame_push(fp->sp, 0, methods[0].locals.size() + 1, methods[0].max_stack);
+    frame->ip = frame->ip_start = methods[0].code.data();
+    if (profile_sequences) {
+        loop_profile();
+    }
+#ifdef HAVE_JIT
+    if (engine == engine_t::jit) {
+        jit_methods.resize(methods.size());
+        jit_runtime = jit::runtime_t{jit_exec, jit_invoke, &classes};
+        for (size_t m = 0; m < methods.size(); ++m) {
+            method_index[methods[m].code.data()] = m;
+        }
+        loop_jit(frames);
+    }
+#endif
+#ifdef HAVE_COMPUTED_GOTO
+    if (engine == engine_t::threaded) {
+        loop_threaded();
+    }
+#endif
     loop();
 }
 
+inline void interpreter_t::dispatch(uint8_t *ip)
+{
+    switch (op_of(ip)) {
+    case bytecode::op_code_t::band_: exec_band(); break;
+    case bytecode::op_code_t::bneg_: exec_bneg(); break;
+    case bytecode::op_code_t::getfield_: exec_getfield(); break;
+    case bytecode::op_code_t::goto_: exec_goto(); break;
+    case bytecode::op_code_t::goto_if_false_: exec_goto_if_false(); break;
+    case bytecode::op_code_t::guard_class_: exec_guard_class(); break;
+    case bytecode::op_code_t::iadd_: exec_iadd(); break;
+    case bytecode::op_code_t::iaload_: exec_iaload(); break;
+    case bytecode::op_code_t::iaload_nc_: exec_iaload_nc(); break;
+    case bytecode::op_code_t::iastore_: exec_iastore(); break;
+    case bytecode::op_code_t::iastore_nc_: exec_iastore_nc(); break;
+    case bytecode::op_code_t::if_false_: exec_if_false(); break;
+    case bytecode::op_code_t::if_ige_: exec_if_ige(); break;
+    case bytecode::op_code_t::if_ilt_: exec_if_ilt(); break;
+    case bytecode::op_code_t::if_true_: exec_if_true(); break;
+    case bytecode::op_code_t::ilt_: exec_ilt(); break;
+    case bytecode::op_code_t::imul_: exec_imul(); break;
+    case bytecode::op_code_t::invoke_: exec_invoke(); break;
+    case bytecode::op_code_t::invoke_direct_: exec_invoke_direct(); break;
+    case bytecode::op_code_t::isub_: exec_isub(); break;
+    case bytecode::op_code_t::load_: exec_load(); break;
+    case bytecode::op_code_t::load_getfield_: exec_load_getfield(); break;
+    case bytecode::op_code_t::load_ldc_iadd_: exec_load_ldc_iadd(); break;
+    case bytecode::op_code_t::load_ldc_isub_: exec_load_ldc_isub(); break;
+    case bytecode::op_code_t::load_load_: exec_load_load(); break;
+    case bytecode::op_code_t::load_load_if_ige_: exec_load_load_if_ige(); break;
+    case bytecode::op_code_t::ldc_: exec_ldc(); break;
+    case bytecode::op_code_t::length_: exec_length(); break;
+    case bytecode::op_code_t::new_: exec_new(); break;
+    case bytecode::op_code_t::newarray_: exec_newarray(); break;
+    case bytecode::op_code_t::putfield_: exec_putfield(); break;
+    case bytecode::op_code_t::print_: exec_print(); break;
+    case bytecode::op_code_t::return_: exec_return(); break;
+    case bytecode::op_code_t::store_: exec_store(); break;
+    default: assert(false);
+    }
+}
+
 void interpreter_t::loop(void)
 {
     while (true) {
         log("loop");
-        auto ip = reinterpret_cast<bytecode::instruction_t *>(fp->ip);
+        dispatch(static_cast<uint8_t *>(fp->ip));
+    }
+}
+
+// `loop` counting the sequences of instructions run in a row by a frame
+void interpreter_t::loop_profile(void)
+{
+    frame_t *last_fp = nullptr;
+    uint8_t *last_ip = nullptr;
+    size_t run = 0; // instructions run in a row, up to the current one
+    size_t ops[2] = {0, 0}; // op codes of the two previous instructions
+    while (true) {
+        auto ip = static_cast<uint8_t *>(fp->ip);
+        auto last_size = bytecode::encoded_size(static_cast<bytecode::op_code_t>(ops[1]));
+        run = fp == last_fp && ip == last_ip + last_size ? run + 1 : 1;
+        auto op = static_cast<size_t>(op_of(ip));
+        profile.executed++;
+        if (run >= 2) {
+            auto pair = ops[1] * NUM_OP_CODES + op;
+            profile.pairs[pair]++;
+            if (run >= 3) {
+                profile.triples[ops[0] * NUM_OP_CODES * NUM_OP_CODES + pair]++;
+            }
+        }
+        last_fp = fp;
+        last_ip = ip;
+        ops[0] = ops[1];
+        ops[1] = op;
+        dispatch(ip);
+    }
+}
+
+#ifdef HAVE_COMPUTED_GOTO
+
+// Direct threaded version of `loop`: the instruction pointer, the operand stack top and
+// the locals base are kept in local variables and only written back to `fp` around
+// calls, returns and allocations (the GC walks the frames from `fp`). Pushes are
+// unchecked, frames are created with room for the `max_stack` of their method.
+void interpreter_t::loop_threaded(void)
+{
+    // must be kept in the same order as `bytecode::op_code_t`
+    static void *dispatch_table[] = {
+        &&op_band,          &&op_bneg,             &&op_getfield,      &&op_goto,
+        &&op_goto_if_false, &&op_guard_class,      &&op_iadd,          &&op_iaload,
+        &&op_iaload_nc,     &&op_iastore,          &&op_iastore_nc,    &&op_if_false,
+        &&op_if_ige,        &&op_if_ilt,           &&op_if_true,       &&op_ilt,
+        &&op_imul,          &&op_invoke,           &&op_invoke_direct, &&op_isub,
+        &&op_load,          &&op_load_getfield,    &&op_load_ldc_iadd, &&op_load_ldc_isub,
+        &&op_load_load,     &&op_load_load_if_ige, &&op_ldc,           &&op_length,
+        &&op_new,           &&op_newarray,         &&op_putfield,      &&op_print,
+        &&op_return,        &&op_store,
+    };
+    static_assert(sizeof(dispatch_table) / sizeof(dispatch_table[0]) ==
+                      static_cast<size_t>(bytecode::op_code_t::store_) + 1,
+                  "dispatch table out of sync with op_code_t");
+
+    uint8_t *ip;
+    uint8_t *ip_start;
+    void **locals;
+    void **sp;
+
+#define LOAD_STATE()                                                                       \
+    do {                                                                                   \
+        ip = static_cast<uint8_t *>(fp->ip);                                               \
+        ip_start = static_cast<uint8_t *>(fp->ip_start);                                   \
+        locals = fp->locals;                                                               \
+        sp = fp->sp;                                                                       \
+    } while (0)
+#define SAVE_STATE()                                                                       \
+    do {                                                                                   \
+        fp->ip = reinterpret_cast<void *>(ip);                                             \
+        fp->sp = sp;                                                                       \
+    } while (0)
+#define PUSH(v)                                                                            \
+    do {                                                                                   \
+        *sp++ = (v);                                                                       \
+    } while (0)
+#define POP() (*--sp)
+#define DISPATCH() goto *dispatch_table[*ip]
+// steps over the instruction, an `op`
+#define NEXT(op)                                                                           \
+    do {                                                                                   \
+        ip += bytecode::encoded_size(bytecode::op_code_t::op);                             \
+        DISPATCH();                                                                        \
+    } while (0)
+#define BINARY_OP(op, expr)                                                                \
+    do {                                                                                   \
+        auto ival2 = ptr_to_int(POP());                                                    \
+        auto ival1 = ptr_to_int(POP());                                                    \
+        PUSH(int_to_ptr(expr));                                                            \
+        NEXT(op);                                                                          \
+    } while (0)
+#define BRANCH_IF(op, cond)                                                                \
+    do {                                                                                   \
+        if (cond) {                                                                        \
+            ip = ip_start + target_of(ip);                                                 \
+            DISPATCH();                                                                    \
+        }                                                                                  \
+        NEXT(op);                                                                          \
+    } while (0)
+
+    LOAD_STATE();
+    DISPATCH();
+
+op_band:
+    BINARY_OP(band_, ival1 & ival2);
+op_bneg:
+{
+    auto ival = ptr_to_int(POP());
+    PUSH(int_to_ptr(!ival));
+    NEXT(bneg_);
+}
+op_getfield:
+{
+    auto hobj = ptr_to_hval(POP());
+    PUSH(reinterpret_cast<void *>(*pith_field(hobj, index_of(ip))));
+    NEXT(getfield_);
+}
+op_goto:
+    ip = ip_start + target_of(ip);
+    DISPATCH();
+op_goto_if_false:
+{
+    auto ival = ptr_to_int(POP());
+    if (ival == 0) {
+        ip = ip_start + target_of(ip);
+        DISPATCH();
+    }
+    NEXT(goto_if_false_);
+}
+op_guard_class:
+    BRANCH_IF(guard_class_, hval_vtable(ptr_to_hval(locals[local_of(ip)])) !=
+                                classes[class_of(ip)].info);
+op_iadd:
+    BINARY_OP(iadd_, ival1 + ival2);
+op_iaload:
+{
+    auto harr = ptr_to_hval(POP());
+    assert(harr->tag & VAL_ARRAY_TAG);
+    auto iidx = ptr_to_int(POP());
+    auto elem = *pith_field_arr_checked(harr, iidx);
+    PUSH(int_to_ptr(elem));
+    NEXT(iaload_);
+}
+op_iaload_nc:
+{
+    auto harr = ptr_to_hval(POP());
+    auto iidx = ptr_to_int(POP());
+    auto elem = *pith_field_arr(harr, iidx);
+    PUSH(int_to_ptr(elem));
+    NEXT(iaload_nc_);
+}
+op_iastore:
+{
+    auto harr = ptr_to_hval(POP());
+    assert(harr->tag & VAL_ARRAY_TAG);
+    auto val = POP();
+    auto iidx = ptr_to_int(POP());
+    *pith_field_arr_checked(harr, iidx) = ptr_to_int(val);
+    NEXT(iastore_);
+}
+op_iastore_nc:
+{
+    auto harr = ptr_to_hval(POP());
+    auto val = POP();
+    auto iidx = ptr_to_int(POP());
+    *pith_field_arr(harr, iidx) = ptr_to_int(val);
+    NEXT(iastore_nc_);
+}
+op_if_false:
+    BRANCH_IF(if_false_, ptr_to_int(locals[local_of(ip)]) == 0);
+op_if_ige:
+{
+    auto ival2 = ptr_to_int(POP());
+    auto ival1 = ptr_to_int(POP());
+    BRANCH_IF(if_ige_, !(ival1 < ival2));
+}
+op_if_ilt:
+{
+    auto ival2 = ptr_to_int(POP());
+    auto ival1 = ptr_to_int(POP());
+    BRANCH_IF(if_ilt_, ival1 < ival2);
+}
+op_if_true:
+    BRANCH_IF(if_true_, ptr_to_int(locals[local_of(ip)]) != 0);
+op_ilt:
+    BINARY_OP(ilt_, (ival1 < ival2) ? 1 : 0);
+op_imul:
+    BINARY_OP(imul_, ival1 * ival2);
+op_invoke:
+    SAVE_STATE();
+    exec_invoke();
+    LOAD_STATE();
+    DISPATCH();
+op_invoke_direct:
+    SAVE_STATE();
+    exec_invoke_direct();
+    LOAD_STATE();
+    DISPATCH();
+op_isub:
+    BINARY_OP(isub_, ival1 - ival2);
+op_load:
+    PUSH(locals[index_of(ip)]);
+    NEXT(load_);
+op_load_getfield:
+{
+    auto hobj = ptr_to_hval(locals[index_of(ip)]);
+    PUSH(reinterpret_cast<void *>(*pith_field(hobj, index2_of(ip))));
+    ip += fused_size(bytecode::op_code_t::load_getfield_);
+    DISPATCH();
+}
+op_load_ldc_iadd:
+    PUSH(int_to_ptr(ptr_to_int(locals[index_of(ip)]) + constant2_of(ip)));
+    ip += fused_size(bytecode::op_code_t::load_ldc_iadd_);
+    DISPATCH();
+op_load_ldc_isub:
+    PUSH(int_to_ptr(ptr_to_int(locals[index_of(ip)]) - constant2_of(ip)));
+    ip += fused_size(bytecode::op_code_t::load_ldc_isub_);
+    DISPATCH();
+op_load_load:
+    PUSH(locals[index_of(ip)]);
+    PUSH(locals[index2_of(ip)]);
+    ip += fused_size(bytecode::op_code_t::load_load_);
+    DISPATCH();
+op_load_load_if_ige:
+{
+    auto ival1 = ptr_to_int(locals[index_of(ip)]);
+    auto ival2 = ptr_to_int(locals[index2_of(ip)]);
+    if (!(ival1 < ival2)) {
+        ip = ip_start + if_ige_target(ip);
+        DISPATCH();
+    }
+    ip += fused_size(bytecode::op_code_t::load_load_if_ige_);
+    DISPATCH();
+}
+op_ldc:
+    PUSH(int_to_ptr(constant_of(ip)));
+    NEXT(ldc_);
+op_length:
+{
+    auto harr = ptr_to_hval(POP());
+    assert(harr->tag & VAL_ARRAY_TAG);
+    PUSH(int_to_ptr(harr->size));
+    NEXT(length_);
+}
+op_new:
+    SAVE_STATE();
+    exec_new();
+    LOAD_STATE();
+    DISPATCH();
+op_newarray:
+    SAVE_STATE();
+    exec_newarray();
+    LOAD_STATE();
+    DISPATCH();
+op_putfield:
+{
+    auto hobj = ptr_to_hval(POP());
+    auto val = POP();
+    write_barrier(hobj, val);
+    *pith_field(hobj, index_of(ip)) = reinterpret_cast<int64_t>(val);
+    NEXT(putfield_);
+}
+op_print:
+    std::cout << ptr_to_int(POP()) << "\n";
+    NEXT(print_);
+op_return:
+    SAVE_STATE();
+    exec_return();
+    LOAD_STATE();
+    DISPATCH();
+op_store:
+    locals[index_of(ip)] = POP();
+    NEXT(store_);
+
+#undef LOAD_STATE
+#undef SAVE_STATE
+#undef PUSH
+#undef POP
+#undef DISPATCH
+#undef NEXT
+#undef BINARY_OP
+#undef BRANCH_IF
+}
+
+#endif // HAVE_COMPUTED_GOTO
+
+// Interpreter for the register bytecode. Registers live in `fp->locals`, and the GC finds
+// the references among them with the register stack maps; there is no operand stack.
+void interpreter_t::loop_register(void)
+{
+    using bytecode::reg_op_code_t;
+    auto ip = reinterpret_cast<bytecode::reg_instruction_t *>(fp->ip);
+    auto ip_start = reinterpret_cast<bytecode::reg_instruction_t *>(fp->ip_start);
+    auto r = fp->locals;
+    while (true) {
+        log("loop_register");
         switch (ip->op_code) {
-        case bytecode::op_code_t::band_: exec_band(); break;
-        case bytecode::op_code_t::bneg_: exec_bneg(); break;
-        case bytecode::op_code_t::getfield_: exec_getfield(); break;
-        case bytecode::op_code_t::goto_: exec_goto(); break;
-        case bytecode::op_code_t::goto_if_false_: exec_goto_if_false(); break;
-        case bytecode::op_code_t::iadd_: exec_iadd(); break;
-        case bytecode::op_code_t::iaload_: exec_iaload(); break;
-        case bytecode::op_code_t::iastore_: exec_iastore(); break;
-        case bytecode::op_code_t::ilt_: exec_ilt(); break;
-        case bytecode::op_code_t::imul_: exec_imul(); break;
-        case bytecode::op_code_t::invoke_: exec_invoke(); break;
-        case bytecode::op_code_t::isub_: exec_isub(); break;
-        case bytecode::op_code_t::load_: exec_load(); break;
-        case bytecode::op_code_t::ldc_: exec_ldc(); break;
-        case bytecode::op_code_t::length_: exec_length(); break;
-        case bytecode::op_code_t::new_: exec_new(); break;
-        case bytecode::op_code_t::newarray_: exec_newarray(); break;
-        case bytecode::op_code_t::putfield_: exec_putfield(); break;
-        case bytecode::op_code_t::print_: exec_print(); break;
-        case bytecode::op_code_t::return_: exec_return(); break;
-        case bytecode::op_code_t::store_: exec_store(); break;
+        case reg_op_code_t::band_:
+            r[ip->a] = int_to_ptr(ptr_to_int(r[ip->b]) & ptr_to_int(r[ip->c]));
+            ip += 1;
+            break;
+        case reg_op_code_t::bneg_:
+            r[ip->a] = int_to_ptr(!ptr_to_int(r[ip->b]));
+            ip += 1;
+            break;
+        case reg_op_code_t::getfield_:
+            r[ip->a] = reinterpret_cast<void *>(*pith_field(ptr_to_hval(r[ip->b]), ip->c));
+            ip += 1;
+            break;
+        case reg_op_code_t::guard_class_:
+            if (hval_vtable(ptr_to_hval(r[ip->a])) != classes[ip->b].info) {
+                ip = ip_start + ip->c;
+            }
+            else {
+                ip += 1;
+            }
+            break;
+        case reg_op_code_t::iadd_:
+            r[ip->a] = int_to_ptr(ptr_to_int(r[ip->b]) + ptr_to_int(r[ip->c]));
+            ip += 1;
+            break;
+        case reg_op_code_t::iaddk_:
+            r[ip->a] = int_to_ptr(ptr_to_int(r[ip->b]) + ip->c);
+            ip += 1;
+            break;
+        case reg_op_code_t::iaload_: {
+            auto harr = ptr_to_hval(r[ip->b]);
+            assert(harr->tag & VAL_ARRAY_TAG);
+            auto elem = *pith_field_arr_checked(harr, ptr_to_int(r[ip->c]));
+            r[ip->a] = int_to_ptr(elem);
+            ip += 1;
+            break;
+        }
+        case reg_op_code_t::iaload_nc_: {
+            auto elem = *pith_field_arr(ptr_to_hval(r[ip->b]), ptr_to_int(r[ip->c]));
+            r[ip->a] = int_to_ptr(elem);
+            ip += 1;
+            break;
+        }
+        case reg_op_code_t::iastore_: {
+            auto harr = ptr_to_hval(r[ip->a]);
+            assert(harr->tag & VAL_ARRAY_TAG);
+            *pith_field_arr_checked(harr, ptr_to_int(r[ip->b])) = ptr_to_int(r[ip->c]);
+            ip += 1;
+            break;
+        }
+        case reg_op_code_t::iastore_nc_: {
+            auto harr = ptr_to_hval(r[ip->a]);
+            *pith_field_arr(harr, ptr_to_int(r[ip->b])) = ptr_to_int(r[ip->c]);
+            ip += 1;
+            break;
+        }
+        case reg_op_code_t::ilt_:
+            r[ip->a] = int_to_ptr(ptr_to_int(r[ip->b]) < ptr_to_int(r[ip->c]) ? 1 : 0);
+            ip += 1;
+            break;
+        case reg_op_code_t::ilt_jf_:
+            if (ptr_to_int(r[ip->a]) < ptr_to_int(r[ip->b])) {
+                ip += 1;
+            }
+            else {
+                ip = ip_start + ip->c;
+            }
+            break;
+        case reg_op_code_t::ilt_jt_:
+            if (ptr_to_int(r[ip->a]) < ptr_to_int(r[ip->b])) {
+                ip = ip_start + ip->c;
+            }
+            else {
+                ip += 1;
+            }
+            break;
+        case reg_op_code_t::imul_:
+            r[ip->a] = int_to_ptr(ptr_to_int(r[ip->b]) * ptr_to_int(r[ip->c]));
+            ip += 1;
+            break;
+        case reg_op_code_t::invoke_:
+            fp->ip = reinterpret_cast<void *>(ip);
+            exec_reg_invoke();
+            ip = reinterpret_cast<bytecode::reg_instruction_t *>(fp->ip);
+            ip_start = reinterpret_cast<bytecode::reg_instruction_t *>(fp->ip_start);
+            r = fp->locals;
+            break;
+        case reg_op_code_t::invoke_direct_:
+            fp->ip = reinterpret_cast<void *>(ip);
+            exec_reg_invoke_direct();
+            ip = reinterpret_cast<bytecode::reg_instruction_t *>(fp->ip);
+            ip_start = reinterpret_cast<bytecode::reg_instruction_t *>(fp->ip_start);
+            r = fp->locals;
+            break;
+        case reg_op_code_t::isub_:
+            r[ip->a] = int_to_ptr(ptr_to_int(r[ip->b]) - ptr_to_int(r[ip->c]));
+            ip += 1;
+            break;
+        case reg_op_code_t::isubk_:
+            r[ip->a] = int_to_ptr(ptr_to_int(r[ip->b]) - ip->c);
+            ip += 1;
+            break;
+        case reg_op_code_t::jf_:
+            if (ptr_to_int(r[ip->a]) == 0) {
+                ip = ip_start + ip->b;
+            }
+            else {
+                ip += 1;
+            }
+            break;
+        case reg_op_code_t::jmp_: ip = ip_start + ip->a; break;
+        case reg_op_code_t::jt_:
+            if (ptr_to_int(r[ip->a]) != 0) {
+                ip = ip_start + ip->b;
+            }
+            else {
+                ip += 1;
+            }
+            break;
+        case reg_op_code_t::ldc_:
+            r[ip->a] = int_to_ptr(ip->b);
+            ip += 1;
+            break;
+        case reg_op_code_t::length_: {
+            auto harr = ptr_to_hval(r[ip->b]);
+            assert(harr->tag & VAL_ARRAY_TAG);
+            r[ip->a] = int_to_ptr(harr->size);
+            ip += 1;
+            break;
+        }
+        case reg_op_code_t::mov_:
+            r[ip->a] = r[ip->b];
+            ip += 1;
+            break;
+        case reg_op_code_t::new_: {
+            // the GC reads the stack map of the allocation
+            fp->ip = reinterpret_cast<void *>(ip);
+            auto &class_layout = classes.at(ip->b);
+            auto vtable = reinterpret_cast<void *>(class_layout.info);
+            r[ip->a] = alloc_heapval(vtable, class_layout.fields.size());
+            ip += 1;
+            break;
+        }
+        case reg_op_code_t::newarray_:
+            fp->ip = reinterpret_cast<void *>(ip);
+            r[ip->a] = alloc_arr(ptr_to_int(r[ip->b]));
+            ip += 1;
+            break;
+        case reg_op_code_t::print_:
+            std::cout << ptr_to_int(r[ip->a]) << "\n";
+            ip += 1;
+            break;
+        case reg_op_code_t::putfield_: {
+            auto hobj = ptr_to_hval(r[ip->a]);
+            write_barrier(hobj, r[ip->c]);
+            *pith_field(hobj, ip->b) = reinterpret_cast<int64_t>(r[ip->c]);
+            ip += 1;
+            break;
+        }
+        case reg_op_code_t::return_:
+            fp->ip = reinterpret_cast<void *>(ip);
+            exec_reg_return();
+            ip = reinterpret_cast<bytecode::reg_instruction_t *>(fp->ip);
+            ip_start = reinterpret_cast<bytecode::reg_instruction_t *>(fp->ip_start);
+            r = fp->locals;
+            break;
         default: assert(false);
         }
     }
@@ -141,302 +1105,470 @@ void interpreter_t::loop(void)
 void interpreter_t::exec_band(void)
 {
     log("exec_band");
-    auto val2 = vector_pop(&fp->val_stack);
-    auto val1 = vector_pop(&fp->val_stack);
+    auto val2 = stack_pop(fp);
+    auto val1 = stack_pop(fp);
     auto ival1 = ptr_to_int(val1);
     auto ival2 = ptr_to_int(val2);
     auto iresult = ival1 & ival2;
     auto result = int_to_ptr(iresult);
-    vector_push(&fp->val_stack, result);
-    auto ip = reinterpret_cast<bytecode::instruction_t *>(fp->ip);
-    ip += 1;
+    stack_push(fp, result);
+    auto ip = static_cast<uint8_t *>(fp->ip);
+    ip += bytecode::encoded_size(bytecode::op_code_t::band_);
     fp->ip = reinterpret_cast<void *>(ip);
 }
 
 void interpreter_t::exec_bneg(void)
 {
     log("exec_bneg");
-    auto val = vector_pop(&fp->val_stack);
+    auto val = stack_pop(fp);
     auto ival = ptr_to_int(val);
     ival = !ival;
     auto result = int_to_ptr(ival);
-    vector_push(&fp->val_stack, result);
-    auto ip = reinterpret_cast<bytecode::instruction_t *>(fp->ip);
-    ip += 1;
+    stack_push(fp, result);
+    auto ip = static_cast<uint8_t *>(fp->ip);
+    ip += bytecode::encoded_size(bytecode::op_code_t::bneg_);
     fp->ip = reinterpret_cast<void *>(ip);
 }
 
 void interpreter_t::exec_getfield(void)
 {
     log("exec_getfield");
-    auto obj = vector_pop(&fp->val_stack);
+    auto obj = stack_pop(fp);
     auto hobj = ptr_to_hval(obj);
-    auto ip = reinterpret_cast<bytecode::instruction_t *>(fp->ip);
-    auto field_idx = ip->operand;
+    auto ip = static_cast<uint8_t *>(fp->ip);
+    auto field_idx = index_of(ip);
     auto pfield = pith_field(hobj, field_idx);
     auto field = *pfield;
-    vector_push(&fp->val_stack, reinterpret_cast<void *>(field));
-    ip += 1;
+    stack_push(fp, reinterpret_cast<void *>(field));
+    ip += bytecode::encoded_size(bytecode::op_code_t::getfield_);
+    fp->ip = reinterpret_cast<void *>(ip);
+}
+
+// goes to the target of the branch `fp` is on if `taken`, to the next instruction otherwise
+static void branch(bool taken)
+{
+    auto ip = static_cast<uint8_t *>(fp->ip);
+    if (taken) {
+        ip = static_cast<uint8_t *>(fp->ip_start) + target_of(ip);
+    }
+    else {
+        ip += bytecode::encoded_size(op_of(ip));
+    }
     fp->ip = reinterpret_cast<void *>(ip);
 }
 
 void interpreter_t::exec_goto(void)
 {
     log("exec_goto");
-    auto ip = reinterpret_cast<bytecode::instruction_t *>(fp->ip);
+    auto ip = static_cast<uint8_t *>(fp->ip);
     fp->ip = reinterpret_cast<void *>(
-        reinterpret_cast<bytecode::instruction_t *>(fp->ip_start) + ip->operand);
+        static_cast<uint8_t *>(fp->ip_start) + target_of(ip));
 }
 
 void interpreter_t::exec_goto_if_false(void)
 {
     log("exec_goto_if_false");
-    auto val = vector_pop(&fp->val_stack);
+    auto val = stack_pop(fp);
     auto ival = ptr_to_int(val);
-    auto ip = reinterpret_cast<bytecode::instruction_t *>(fp->ip);
+    auto ip = static_cast<uint8_t *>(fp->ip);
     if (ival == 0) {
         fp->ip = reinterpret_cast<void *>(
-            reinterpret_cast<bytecode::instruction_t *>(fp->ip_start) + ip->operand);
+            static_cast<uint8_t *>(fp->ip_start) + target_of(ip));
     }
     else {
-        ip += 1;
+        ip += bytecode::encoded_size(bytecode::op_code_t::goto_if_false_);
         fp->ip = reinterpret_cast<void *>(ip);
     }
 }
 
+void interpreter_t::exec_guard_class(void)
+{
+    log("exec_guard_class");
+    auto ip = static_cast<uint8_t *>(fp->ip);
+    auto hobj = ptr_to_hval(fp->locals[local_of(ip)]);
+    branch(hval_vtable(hobj) != classes[class_of(ip)].info);
+}
+
 void interpreter_t::exec_iadd(void)
 {
     log("exec_iadd");
-    auto val2 = vector_pop(&fp->val_stack);
-    auto val1 = vector_pop(&fp->val_stack);
+    auto val2 = stack_pop(fp);
+    auto val1 = stack_pop(fp);
     auto ival1 = ptr_to_int(val1);
     auto ival2 = ptr_to_int(val2);
     auto iresult = ival1 + ival2;
     auto result = int_to_ptr(iresult);
-    vector_push(&fp->val_stack, result);
-    auto ip = reinterpret_cast<bytecode::instruction_t *>(fp->ip);
-    ip += 1;
+    stack_push(fp, result);
+    auto ip = static_cast<uint8_t *>(fp->ip);
+    ip += bytecode::encoded_size(bytecode::op_code_t::iadd_);
     fp->ip = reinterpret_cast<void *>(ip);
 }
 
 void interpreter_t::exec_iaload(void)
 {
     log("exec_iaload");
-    auto arr = vector_pop(&fp->val_stack);
+    auto arr = stack_pop(fp);
     auto harr = ptr_to_hval(arr);
     assert(harr->tag & VAL_ARRAY_TAG);
-    auto idx = vector_pop(&fp->val_stack);
+    auto idx = stack_pop(fp);
     auto iidx = ptr_to_int(idx);
-    auto elem = *pith_field_arr(harr, iidx);
-    elem |= VAL_INT_TAG;
-    vector_push(&fp->val_stack, reinterpret_cast<void *>(elem));
-    auto ip = reinterpret_cast<bytecode::instruction_t *>(fp->ip);
-    ip += 1;
+    auto elem = *pith_field_arr_checked(harr, iidx);
+    stack_push(fp, int_to_ptr(elem));
+    auto ip = static_cast<uint8_t *>(fp->ip);
+    ip += bytecode::encoded_size(bytecode::op_code_t::iaload_);
+    fp->ip = reinterpret_cast<void *>(ip);
+}
+
+void interpreter_t::exec_iaload_nc(void)
+{
+    log("exec_iaload_nc");
+    auto harr = ptr_to_hval(stack_pop(fp));
+    auto iidx = ptr_to_int(stack_pop(fp));
+    stack_push(fp, int_to_ptr(*pith_field_arr(harr, iidx)));
+    auto ip = static_cast<uint8_t *>(fp->ip);
+    ip += bytecode::encoded_size(bytecode::op_code_t::iaload_nc_);
     fp->ip = reinterpret_cast<void *>(ip);
 }
 
 void interpreter_t::exec_iastore(void)
 {
     log("exec_iastore");
-    auto arr = vector_pop(&fp->val_stack);
+    auto arr = stack_pop(fp);
     auto harr = ptr_to_hval(arr);
     assert(harr->tag & VAL_ARRAY_TAG);
-    auto val = vector_pop(&fp->val_stack);
-    auto idx = vector_pop(&fp->val_stack);
+    auto val = stack_pop(fp);
+    auto idx = stack_pop(fp);
     auto iidx = ptr_to_int(idx);
-    auto pfield = pith_field_arr(harr, iidx);
-    *pfield = reinterpret_cast<int64_t>(val);
-    auto ip = reinterpret_cast<bytecode::instruction_t *>(fp->ip);
-    ip += 1;
+    auto pfield = pith_field_arr_checked(harr, iidx);
+    *pfield = ptr_to_int(val);
+    auto ip = static_cast<uint8_t *>(fp->ip);
+    ip += bytecode::encoded_size(bytecode::op_code_t::iastore_);
+    fp->ip = reinterpret_cast<void *>(ip);
+}
+
+void interpreter_t::exec_iastore_nc(void)
+{
+    log("exec_iastore_nc");
+    auto harr = ptr_to_hval(stack_pop(fp));
+    auto val = stack_pop(fp);
+    auto iidx = ptr_to_int(stack_pop(fp));
+    *pith_field_arr(harr, iidx) = ptr_to_int(val);
+    auto ip = static_cast<uint8_t *>(fp->ip);
+    ip += bytecode::encoded_size(bytecode::op_code_t::iastore_nc_);
     fp->ip = reinterpret_cast<void *>(ip);
 }
 
+void interpreter_t::exec_if_false(void)
+{
+    log("exec_if_false");
+    auto ip = static_cast<uint8_t *>(fp->ip);
+    branch(ptr_to_int(fp->locals[local_of(ip)]) == 0);
+}
+
+void interpreter_t::exec_if_ige(void)
+{
+    log("exec_if_ige");
+    auto ival2 = ptr_to_int(stack_pop(fp));
+    auto ival1 = ptr_to_int(stack_pop(fp));
+    branch(!(ival1 < ival2));
+}
+
+void interpreter_t::exec_if_ilt(void)
+{
+    log("exec_if_ilt");
+    auto ival2 = ptr_to_int(stack_pop(fp));
+    auto ival1 = ptr_to_int(stack_pop(fp));
+    branch(ival1 < ival2);
+}
+
+void interpreter_t::exec_if_true(void)
+{
+    log("exec_if_true");
+    auto ip = static_cast<uint8_t *>(fp->ip);
+    branch(ptr_to_int(fp->locals[local_of(ip)]) != 0);
+}
+
 void interpreter_t::exec_ilt(void)
 {
     log("exec_ilt");
-    auto val2 = vector_pop(&fp->val_stack);
-    auto val1 = vector_pop(&fp->val_stack);
+    auto val2 = stack_pop(fp);
+    auto val1 = stack_pop(fp);
     auto ival1 = ptr_to_int(val1);
     auto ival2 = ptr_to_int(val2);
     auto iresult = (ival1 < ival2) ? 1 : 0;
     auto result = int_to_ptr(iresult);
-    vector_push(&fp->val_stack, result);
-    auto ip = reinterpret_cast<bytecode::instruction_t *>(fp->ip);
-    ip += 1;
+    stack_push(fp, result);
+    auto ip = static_cast<uint8_t *>(fp->ip);
+    ip += bytecode::encoded_size(bytecode::op_code_t::ilt_);
     fp->ip = reinterpret_cast<void *>(ip);
 }
 
 void interpreter_t::exec_imul(void)
 {
     log("exec_imul");
-    auto val2 = vector_pop(&fp->val_stack);
-    auto val1 = vector_pop(&fp->val_stack);
+    auto val2 = stack_pop(fp);
+    auto val1 = stack_pop(fp);
     auto ival1 = ptr_to_int(val1);
     auto ival2 = ptr_to_int(val2);
     auto iresult = ival1 * ival2;
     auto result = int_to_ptr(iresult);
-    vector_push(&fp->val_stack, result);
-    auto ip = reinterpret_cast<bytecode::instruction_t *>(fp->ip);
-    ip += 1;
+    stack_push(fp, result);
+    auto ip = static_cast<uint8_t *>(fp->ip);
+    ip += bytecode::encoded_size(bytecode::op_code_t::imul_);
     fp->ip = reinterpret_cast<void *>(ip);
 }
 
 void interpreter_t::exec_invoke(void)
 {
     log("exec_invoke");
-    auto ip = reinterpret_cast<bytecode::instruction_t *>(fp->ip);
-    auto method_idx = ip->operand;
-    auto nargs = ip->operand2;
-    auto frame = frame_create();
-    std::vector<void *> args;
-    for (size_t i = 1; i < nargs; ++i) {
-        auto v = vector_pop(&fp->val_stack);
-        args.push_back(v);
-    }
-    std::reverse(args.begin(), args.end());
-    auto obj = vector_pop(&fp->val_stack);
-    auto hobj = ptr_to_hval(obj);
-    auto vtable =
-        reinterpret_cast<std::vector<bc_compiler::method_layout_t *> *>(hobj->vtable);
-    auto method = (*vtable)[method_idx];
-    vector_push(&frame->locals, obj);
-    for (auto &arg : args) {
-        vector_push(&frame->locals, arg);
-    }
-    for (size_t i = 0; i < method->locals.size(); ++i) {
-        vector_push(&frame->locals, nullptr);
-    }
-    frame->ip = frame->ip_start = reinterpret_cast<void *>(&method->instructions[0]);
-    vector_push(&frames, frame);
-    fp = frame;
+    auto ip = static_cast<uint8_t *>(fp->ip);
+    auto method_idx = index_of(ip);
+    auto nargs = nargs_of(ip);
+    // the arguments on the operand stack become the first locals of the callee
+    auto args = fp->sp - nargs;
+    auto hobj = ptr_to_hval(args[0]);
+    auto target = ic_lookup(inline_caches[cache_of(ip)], hval_vtable(hobj), method_idx);
+    fp->sp = args;
+    auto frame = frame_push(args, nargs, target->nlocals, target->max_stack);
+    frame->ip = frame->ip_start = target->ip_start;
+}
+
+void interpreter_t::exec_invoke_direct(void)
+{
+    log("exec_invoke_direct");
+    auto ip = static_cast<uint8_t *>(fp->ip);
+    auto &method = methods[index_of(ip)];
+    auto nargs = nargs_of(ip);
+    auto args = fp->sp - nargs;
+    // the call was devirtualized for the static class of the receiver, which takes the
+    // place of the inline cache, and its subclasses
+    assert(args[0] == nullptr ||
+           class_is_subclass(
+               static_cast<class_info_t *>(hval_vtable(ptr_to_hval(args[0]))),
+               classes[cache_of(ip)].info));
+    fp->sp = args;
+    auto frame = frame_push(args, nargs, method.locals.size(), method.max_stack);
+    frame->ip = frame->ip_start = method.code.data();
 }
 
 void interpreter_t::exec_isub(void)
 {
     log("exec_isub");
-    auto val2 = vector_pop(&fp->val_stack);
-    auto val1 = vector_pop(&fp->val_stack);
+    auto val2 = stack_pop(fp);
+    auto val1 = stack_pop(fp);
     auto ival1 = ptr_to_int(val1);
     auto ival2 = ptr_to_int(val2);
     auto iresult = ival1 - ival2;
     auto result = int_to_ptr(iresult);
-    vector_push(&fp->val_stack, result);
-    auto ip = reinterpret_cast<bytecode::instruction_t *>(fp->ip);
-    ip += 1;
+    stack_push(fp, result);
+    auto ip = static_cast<uint8_t *>(fp->ip);
+    ip += bytecode::encoded_size(bytecode::op_code_t::isub_);
     fp->ip = reinterpret_cast<void *>(ip);
 }
 
 void interpreter_t::exec_load(void)
 {
     log("exec_load");
-    auto ip = reinterpret_cast<bytecode::instruction_t *>(fp->ip);
-    auto idx = ip->operand;
-    auto val = vector_get(&fp->locals, idx);
-    vector_push(&fp->val_stack, val);
-    ip += 1;
+    auto ip = static_cast<uint8_t *>(fp->ip);
+    auto idx = index_of(ip);
+    auto val = fp->locals[idx];
+    stack_push(fp, val);
+    ip += bytecode::encoded_size(bytecode::op_code_t::load_);
+    fp->ip = reinterpret_cast<void *>(ip);
+}
+
+void interpreter_t::exec_load_getfield(void)
+{
+    log("exec_load_getfield");
+    auto ip = static_cast<uint8_t *>(fp->ip);
+    auto hobj = ptr_to_hval(fp->locals[index_of(ip)]);
+    stack_push(fp, reinterpret_cast<void *>(*pith_field(hobj, index2_of(ip))));
+    ip += fused_size(bytecode::op_code_t::load_getfield_);
+    fp->ip = reinterpret_cast<void *>(ip);
+}
+
+void interpreter_t::exec_load_ldc_iadd(void)
+{
+    log("exec_load_ldc_iadd");
+    auto ip = static_cast<uint8_t *>(fp->ip);
+    auto ival = ptr_to_int(fp->locals[index_of(ip)]);
+    stack_push(fp, int_to_ptr(ival + constant2_of(ip)));
+    ip += fused_size(bytecode::op_code_t::load_ldc_iadd_);
+    fp->ip = reinterpret_cast<void *>(ip);
+}
+
+void interpreter_t::exec_load_ldc_isub(void)
+{
+    log("exec_load_ldc_isub");
+    auto ip = static_cast<uint8_t *>(fp->ip);
+    auto ival = ptr_to_int(fp->locals[index_of(ip)]);
+    stack_push(fp, int_to_ptr(ival - constant2_of(ip)));
+    ip += fused_size(bytecode::op_code_t::load_ldc_isub_);
+    fp->ip = reinterpret_cast<void *>(ip);
+}
+
+void interpreter_t::exec_load_load(void)
+{
+    log("exec_load_load");
+    auto ip = static_cast<uint8_t *>(fp->ip);
+    stack_push(fp, fp->locals[index_of(ip)]);
+    stack_push(fp, fp->locals[index2_of(ip)]);
+    ip += fused_size(bytecode::op_code_t::load_load_);
+    fp->ip = reinterpret_cast<void *>(ip);
+}
+
+void interpreter_t::exec_load_load_if_ige(void)
+{
+    log("exec_load_load_if_ige");
+    auto ip = static_cast<uint8_t *>(fp->ip);
+    auto ival1 = ptr_to_int(fp->locals[index_of(ip)]);
+    auto ival2 = ptr_to_int(fp->locals[index2_of(ip)]);
+    if (!(ival1 < ival2)) {
+        ip = static_cast<uint8_t *>(fp->ip_start) + if_ige_target(ip);
+    }
+    else {
+        ip += fused_size(bytecode::op_code_t::load_load_if_ige_);
+    }
     fp->ip = reinterpret_cast<void *>(ip);
 }
 
 void interpreter_t::exec_ldc(void)
 {
     log("exec_ldc");
-    auto ip = reinterpret_cast<bytecode::instruction_t *>(fp->ip);
-    auto idx = ip->operand;
-    auto val = reinterpret_cast<void *>((idx << 1) | VAL_INT_TAG);
-    vector_push(&fp->val_stack, val);
-    ip += 1;
+    auto ip = static_cast<uint8_t *>(fp->ip);
+    auto idx = constant_of(ip);
+    auto val = int_to_ptr(idx);
+    stack_push(fp, val);
+    ip += bytecode::encoded_size(bytecode::op_code_t::ldc_);
     fp->ip = reinterpret_cast<void *>(ip);
 }
 
 void interpreter_t::exec_length(void)
 {
     log("exec_length");
-    auto arr = vector_pop(&fp->val_stack);
+    auto arr = stack_pop(fp);
     auto harr = ptr_to_hval(arr);
     assert(harr->tag & VAL_ARRAY_TAG);
     auto ilen = harr->size;
     auto len = int_to_ptr(ilen);
-    vector_push(&fp->val_stack, len);
-    auto ip = reinterpret_cast<bytecode::instruction_t *>(fp->ip);
-    ip += 1;
+    stack_push(fp, len);
+    auto ip = static_cast<uint8_t *>(fp->ip);
+    ip += bytecode::encoded_size(bytecode::op_code_t::length_);
     fp->ip = reinterpret_cast<void *>(ip);
 }
 
 void interpreter_t::exec_new(void)
 {
     log("exec_new");
-    auto ip = reinterpret_cast<bytecode::instruction_t *>(fp->ip);
-    auto &class_layout = classes.at(ip->operand);
-    auto vtable = reinterpret_cast<std::vector<bc_compiler::method_layout_t *> *>(
-        &(class_layout.vtable));
+    auto ip = static_cast<uint8_t *>(fp->ip);
+    auto &class_layout = classes.at(index_of(ip));
+    auto vtable = class_layout.info;
     assert((reinterpret_cast<int64_t>(vtable) & 7) == 0); // 8-byte alignment
     auto nfields = class_layout.fields.size();
     auto obj = alloc_heapval(reinterpret_cast<void *>(vtable), nfields);
-    vector_push(&fp->val_stack, reinterpret_cast<void *>(obj));
-    ip += 1;
+    stack_push(fp, reinterpret_cast<void *>(obj));
+    ip += bytecode::encoded_size(bytecode::op_code_t::new_);
     fp->ip = reinterpret_cast<void *>(ip);
 }
 
 void interpreter_t::exec_newarray(void)
 {
     log("exec_newarray");
-    auto len = vector_pop(&fp->val_stack);
+    auto len = stack_pop(fp);
     auto ilen = ptr_to_int(len);
     auto arr = alloc_arr(ilen);
-    vector_push(&fp->val_stack, reinterpret_cast<void *>(arr));
-    auto ip = reinterpret_cast<bytecode::instruction_t *>(fp->ip);
-    ip += 1;
+    stack_push(fp, reinterpret_cast<void *>(arr));
+    auto ip = static_cast<uint8_t *>(fp->ip);
+    ip += bytecode::encoded_size(bytecode::op_code_t::newarray_);
     fp->ip = reinterpret_cast<void *>(ip);
 }
 
 void interpreter_t::exec_putfield(void)
 {
     log("exec_putfield");
-    auto ip = reinterpret_cast<bytecode::instruction_t *>(fp->ip);
-    auto field_idx = ip->operand;
-    auto obj = vector_pop(&fp->val_stack);
+    auto ip = static_cast<uint8_t *>(fp->ip);
+    auto field_idx = index_of(ip);
+    auto obj = stack_pop(fp);
     auto hobj = ptr_to_hval(obj);
-    auto val = vector_pop(&fp->val_stack);
+    auto val = stack_pop(fp);
+    write_barrier(hobj, val);
     auto pfield = pith_field(hobj, field_idx);
     *pfield = reinterpret_cast<int64_t>(val);
-    ip += 1;
+    ip += bytecode::encoded_size(bytecode::op_code_t::putfield_);
     fp->ip = reinterpret_cast<void *>(ip);
 }
 
 void interpreter_t::exec_print(void)
 {
     log("exec_print");
-    auto val = vector_pop(&fp->val_stack);
+    auto val = stack_pop(fp);
     auto ival = ptr_to_int(val);
     std::cout << ival << "\n";
-    auto ip = reinterpret_cast<bytecode::instruction_t *>(fp->ip);
-    ip += 1;
+    auto ip = static_cast<uint8_t *>(fp->ip);
+    ip += bytecode::encoded_size(bytecode::op_code_t::print_);
     fp->ip = reinterpret_cast<void *>(ip);
 }
 
 void interpreter_t::exec_return(void)
 {
     log("exec_return");
-    if (frames.size == 1) {
-        exit(0);
-    }
-    auto r = vector_pop(&fp->val_stack);
-    vector_pop(&frames);
-    frame_destroy(fp);
-    fp = reinterpret_cast<frame_t *>(vector_top(&frames));
-    vector_push(&fp->val_stack, r);
-    auto ip = reinterpret_cast<bytecode::instruction_t *>(fp->ip);
-    ip += 1;
+    if (fp == frames + 1) {
+        finish();
+    }
+    auto r = stack_pop(fp);
+    frame_pop();
+    stack_push(fp, r);
+    auto ip = static_cast<uint8_t *>(fp->ip);
+    ip += bytecode::encoded_size(bytecode::op_code_t::invoke_);
     fp->ip = reinterpret_cast<void *>(ip);
 }
 
 void interpreter_t::exec_store(void)
 {
     log("exec_store");
-    auto ip = reinterpret_cast<bytecode::instruction_t *>(fp->ip);
-    auto idx = ip->operand;
-    auto val = vector_pop(&fp->val_stack);
-    vector_set(&fp->locals, idx, val);
+    auto ip = static_cast<uint8_t *>(fp->ip);
+    auto idx = index_of(ip);
+    auto val = stack_pop(fp);
+    fp->locals[idx] = val;
+    ip += bytecode::encoded_size(bytecode::op_code_t::store_);
+    fp->ip = reinterpret_cast<void *>(ip);
+}
+
+void interpreter_t::exec_reg_invoke(void)
+{
+    log("exec_reg_invoke");
+    auto ip = reinterpret_cast<bytecode::reg_instruction_t *>(fp->ip);
+    auto base = fp->locals + ip->a;
+    auto nargs = ip->c;
+    auto hobj = ptr_to_hval(base[0]);
+    auto target = ic_lookup(inline_caches[ip->d], hval_vtable(hobj), ip->b);
+    // the callee registers overlap the caller temporaries from the argument registers on
+    auto frame = frame_push(base, nargs, target->nlocals, 0);
+    frame->ip = frame->ip_start = target->ip_start;
+}
+
+void interpreter_t::exec_reg_invoke_direct(void)
+{
+    log("exec_reg_invoke_direct");
+    auto ip = reinterpret_cast<bytecode::reg_instruction_t *>(fp->ip);
+    auto &method = methods[ip->b];
+    auto nlocals = method.nregs - 1 - method.args.size();
+    auto frame = frame_push(fp->locals + ip->a, ip->c, nlocals, 0);
+    frame->ip = frame->ip_start = reinterpret_cast<void *>(&method.reg_instructions[0]);
+}
+
+void interpreter_t::exec_reg_return(void)
+{
+    log("exec_reg_return");
+    if (fp == frames + 1) {
+        finish();
+    }
+    auto ip = reinterpret_cast<bytecode::reg_instruction_t *>(fp->ip);
+    auto r = fp->locals[ip->a];
+    frame_pop();
+    // the caller is suspended on its invoke, whose base register receives the result
+    ip = reinterpret_cast<bytecode::reg_instruction_t *>(fp->ip);
+    fp->locals[ip->a] = r;
     ip += 1;
     fp->ip = reinterpret_cast<void *>(ip);
 }
@@ -445,13 +1577,17 @@ void interpreter_t::exec_store(void)
 
 void usage(const char *progname)
 {
-    fprintf(stderr, "Usage: %s <input file> [--emit-bc]\n", progname);
+    fprintf(stderr,
+            "Usage: %s <input file> [--emit-bc] [--emit-c] [--engine=switch|threaded|register|jit] "
+            "[--stats] [--gc-threads=N] [--profile-sequences] [--inline-budget=N] "
+            "[--jit-threshold=N] [--emit-image <image>]\n",
+            progname);
     exit(1);
 }
 
 int main(int argc, char **argv)
 {
-    if (!(argc == 2 || argc == 3)) {
+    if (argc < 2) {
         usage(argv[0]);
     }
     if (close(0) == -1) {
@@ -461,37 +1597,144 @@ int main(int argc, char **argv)
         perror("open");
     }
     bool emit_bc = false;
-    if (argc == 3) {
-        if (std::strcmp(argv[2], "--emit-bc") == 0) {
+    bool emit_c = false;
+    const char *emit_image = nullptr;
+    bool print_stats = false;
+    bool profile_sequences = false;
+    // largest method inlined, in instructions
+    size_t inline_budget = 8;
+    // calls and back edges of a method before it is compiled
+    size_t jit_threshold = 1000;
+    auto engine = interpreter::engine_t::switch_loop;
+    for (int i = 2; i < argc; i++) {
+        if (std::strcmp(argv[i], "--emit-bc") == 0) {
             emit_bc = true;
         }
+        else if (std::strcmp(argv[i], "--emit-c") == 0) {
+            emit_c = true;
+        }
+        else if (std::strcmp(argv[i], "--emit-image") == 0 && i + 1 < argc) {
+            emit_image = argv[++i];
+        }
+        else if (std::strcmp(argv[i], "--engine=switch") == 0) {
+            engine = interpreter::engine_t::switch_loop;
+        }
+        else if (std::strcmp(argv[i], "--engine=threaded") == 0) {
+#ifdef HAVE_COMPUTED_GOTO
+            engine = interpreter::engine_t::threaded;
+#else
+            fprintf(stderr, "threaded engine not available, using switch\n");
+#endif
+        }
+        else if (std::strcmp(argv[i], "--engine=register") == 0) {
+            engine = interpreter::engine_t::register_;
+        }
+        else if (std::strcmp(argv[i], "--engine=jit") == 0) {
+#ifdef HAVE_JIT
+            engine = interpreter::engine_t::jit;
+#else
+            fprintf(stderr, "jit engine not available, using switch\n");
+#endif
+        }
+        else if (std::strcmp(argv[i], "--stats") == 0) {
+            print_stats = true;
+        }
+        else if (std::strcmp(argv[i], "--profile-sequences") == 0) {
+            profile_sequences = true;
+        }
+        else if (std::strncmp(argv[i], "--inline-budget=", 16) == 0) {
+            char *end;
+            inline_budget = strtoul(argv[i] + 16, &end, 10);
+            if (*end != '\0' || end == argv[i] + 16) {
+                usage(argv[0]);
+            }
+        }
+        else if (std::strncmp(argv[i], "--jit-threshold=", 16) == 0) {
+            char *end;
+            jit_threshold = strtoul(argv[i] + 16, &end, 10);
+            if (*end != '\0' || end == argv[i] + 16) {
+                usage(argv[0]);
+            }
+        }
+        else if (std::strncmp(argv[i], "--gc-threads=", 13) == 0) {
+            gc_threads = atoi(argv[i] + 13);
+            if (gc_threads < 1) {
+                usage(argv[0]);
+            }
+        }
         else {
             usage(argv[0]);
         }
     }
-    scanner::scanner_t scanner = scanner::create_scanner();
-    parser::parser_t parser{std::move(scanner)};
-    auto goal = parser.parse_goal();
-    semantics::semantic_vis_accum_classes_t semantic_vis_accum_classes;
-    goal->accept(&semantic_vis_accum_classes);
-    semantics::semantic_vis_accum_parent_classes_t semantic_vis_accum_parent_classes{semantic_vis_accum_classes.symtbl};
-    goal->accept(&semantic_vis_accum_parent_classes);
-    semantics::semantic_vis_accum_fields_t semantic_vis_accum_fields{semantic_vis_accum_parent_classes.symtbl};
-    goal->accept(&semantic_vis_accum_fields);
-    semantics::semantic_vis_accum_local_vars_t semantic_vis_accum_local_vars{semantic_vis_accum_fields.symtbl};
-    goal->accept(&semantic_vis_accum_local_vars);
-    semantics::semantic_vis_type_check_t semantic_vis_type_check{semantic_vis_accum_local_vars.symtbl};
-    goal->accept(&semantic_vis_type_check);
-    bc_compiler::layout_visitor_t layout_visitor;
-    goal->accept(&layout_visitor);
-    bc_compiler::vt_visitor_t vt_visitor{layout_visitor.classes, layout_visitor.methods};
-    goal->accept(&vt_visitor);
-    bc_compiler::bc_compiler_visitor_t bc_compiler_visitor{vt_visitor.classes, vt_visitor.methods, semantic_vis_type_check};
-    goal->accept(&bc_compiler_visitor);
+    // the profile is taken by the switch loop, on the instructions before fusion
+    if (profile_sequences) {
+        engine = interpreter::engine_t::switch_loop;
+    }
+    std::vector<bc_compiler::class_layout_t> classes;
+    std::vector<bc_compiler::method_layout_t> methods;
+    bc_compiler::inline_stats_t inline_stats;
+    // an image holds the program as compiled below, before the passes which optimize it
+    // from what they prove about it
+    if (!bc_compiler::load_image(0, classes, methods)) {
+        scanner::scanner_t scanner = scanner::create_scanner();
+        parser::parser_t parser{std::move(scanner)};
+        auto goal = parser.parse_goal();
+        semantics::semantic_vis_accum_classes_t semantic_vis_accum_classes;
+        goal->accept(&semantic_vis_accum_classes);
+        semantics::semantic_vis_accum_parent_classes_t semantic_vis_accum_parent_classes{semantic_vis_accum_classes.symtbl};
+        goal->accept(&semantic_vis_accum_parent_classes);
+        semantics::semantic_vis_accum_fields_t semantic_vis_accum_fields{semantic_vis_accum_parent_classes.symtbl};
+        goal->accept(&semantic_vis_accum_fields);
+        semantics::semantic_vis_accum_local_vars_t semantic_vis_accum_local_vars{semantic_vis_accum_fields.symtbl};
+        goal->accept(&semantic_vis_accum_local_vars);
+        semantics::semantic_vis_type_check_t semantic_vis_type_check{semantic_vis_accum_local_vars.symtbl};
+        goal->accept(&semantic_vis_type_check);
+        bc_compiler::layout_visitor_t layout_visitor;
+        goal->accept(&layout_visitor);
+        bc_compiler::vt_visitor_t vt_visitor{layout_visitor.classes, layout_visitor.methods};
+        goal->accept(&vt_visitor);
+        bc_compiler::bc_compiler_visitor_t bc_compiler_visitor{vt_visitor.classes, vt_visitor.methods, semantic_vis_type_check};
+        goal->accept(&bc_compiler_visitor);
+        classes = std::move(bc_compiler_visitor.classes);
+        methods = std::move(bc_compiler_visitor.methods);
+    }
+    // the classes are numbered once for the passes below and the runtime descriptors
+    bc_compiler::number_classes(classes);
+    // the program of an image is checked before the passes below rely on it
+    bc_compiler::verify(classes, methods);
+    if (emit_image) {
+        bc_compiler::write_image(emit_image, classes, methods);
+        return 0;
+    }
+    bc_compiler::inline_methods(classes, methods, inline_budget, inline_stats);
+    bc_compiler::devirtualize(classes, methods, inline_stats);
+    // the inlined code gets its own stack maps, which the collector relies on
+    bc_compiler::verify(classes, methods);
+    for (auto &method : methods) {
+        bc_compiler::eliminate_bounds_checks(method);
+    }
+    for (auto &method : methods) {
+        if (engine == interpreter::engine_t::register_) {
+            bc_compiler::compile_registers(method);
+        }
+        // the JIT and the C backend translate the instructions one by one
+        else if (!profile_sequences && !emit_c && engine != interpreter::engine_t::jit) {
+            bc_compiler::fuse_superinstructions(method);
+        }
+    }
     if (emit_bc) {
-        bc_compiler_visitor.print();
+        bc_compiler::print(methods);
+    }
+    if (emit_c) {
+        bc_compiler::emit_c(classes, methods);
+        return 0;
     }
-    interpreter::interpreter_t interpreter{bc_compiler_visitor.classes, bc_compiler_visitor.methods};
+    interpreter::interpreter_t interpreter{classes, methods};
+    interpreter.engine = engine;
+    interpreter.print_stats = print_stats;
+    interpreter.inline_stats = inline_stats;
+    interpreter.jit_threshold = jit_threshold;
+    interpreter.profile_sequences = profile_sequences;
     interpreter.exec();
     return 0;
 }
\ No newline at end of file
@@ -0,0 +1,460 @@
+#include <cstddef>
+#include <cstring>
+
+#include <sys/mman.h>
+
+#include <jit.h>
+
+// ============================================================================
+// JIT
+// ============================================================================
+
+#ifdef HAVE_JIT
+
+namespace jit {
+
+using bytecode::op_code_t;
+
+enum reg_t { rax, rcx, rdx, rbx, rsp, rbp, rsi, rdi, r8, r9, r10, r11, r12, r13 };
+
+// condition codes, the low nibble of jcc and setcc
+enum cc_t { cc_b = 0x2, cc_ae = 0x3, cc_e = 0x4, cc_ne = 0x5, cc_l = 0xc, cc_ge = 0xd };
+
+// Encoder of the few x86-64 instructions the templates are made of. Memory operands are
+// a base register and a 32 bit displacement.
+struct assembler_t {
+    std::vector<uint8_t> code;
+    void byte(uint8_t b)
+    {
+        code.push_back(b);
+    }
+    void imm32(int32_t i)
+    {
+        for (int k = 0; k < 4; ++k) {
+            byte(static_cast<uint32_t>(i) >> (8 * k));
+        }
+    }
+    void imm64(int64_t i)
+    {
+        for (int k = 0; k < 8; ++k) {
+            byte(static_cast<uint64_t>(i) >> (8 * k));
+        }
+    }
+    void rex(int reg, int index, int base)
+    {
+        byte(0x48 | (reg >> 3) << 2 | (index >> 3) << 1 | base >> 3);
+    }
+    // op reg, [base + disp] (or op [base + disp], reg, depending on the op code)
+    void mem(std::initializer_list<uint8_t> op, int reg, int base, int32_t disp)
+    {
+        rex(reg, 0, base);
+        code.insert(code.end(), op);
+        byte(0x80 | (reg & 7) << 3 | (base & 7));
+        if ((base & 7) == rsp) {
+            byte(0x24);
+        }
+        imm32(disp);
+    }
+    // op reg, [base + index * 8 + 16], an element of an array
+    void element(uint8_t op, int reg, int base, int index)
+    {
+        rex(reg, index, base);
+        byte(op);
+        byte(0x44 | (reg & 7) << 3);
+        byte(0xc0 | (index & 7) << 3 | (base & 7));
+        byte(sizeof(heapval_t));
+    }
+    // op rm, reg
+    void rr(std::initializer_list<uint8_t> op, int reg, int rm)
+    {
+        rex(reg, 0, rm);
+        code.insert(code.end(), op);
+        byte(0xc0 | (reg & 7) << 3 | (rm & 7));
+    }
+    // op rm, imm8, with /ext in the reg field
+    void ri8(int ext, int rm, int8_t imm)
+    {
+        rex(0, 0, rm);
+        byte(0x83);
+        byte(0xc0 | ext << 3 | (rm & 7));
+        byte(imm);
+    }
+    void load(int reg, int base, int32_t disp)
+    {
+        mem({0x8b}, reg, base, disp);
+    }
+    void store(int base, int32_t disp, int reg)
+    {
+        mem({0x89}, reg, base, disp);
+    }
+    void mov(int dst, int src)
+    {
+        rr({0x89}, src, dst);
+    }
+    void mov_imm(int reg, int64_t imm)
+    {
+        rex(0, 0, reg);
+        byte(0xb8 | (reg & 7));
+        imm64(imm);
+    }
+    void mov_imm(int reg, const void *p)
+    {
+        mov_imm(reg, reinterpret_cast<int64_t>(p));
+    }
+    // rax = 1 if the condition holds, 0 otherwise
+    void setcc(cc_t cc)
+    {
+        code.insert(code.end(), {0x0f, static_cast<uint8_t>(0x90 | cc), 0xc0});
+        code.insert(code.end(), {0x0f, 0xb6, 0xc0});
+    }
+    void push(int reg)
+    {
+        if (reg >= r8) {
+            byte(0x41);
+        }
+        byte(0x50 | (reg & 7));
+    }
+    void pop(int reg)
+    {
+        if (reg >= r8) {
+            byte(0x41);
+        }
+        byte(0x58 | (reg & 7));
+    }
+    void call(const void *f)
+    {
+        mov_imm(rax, f);
+        code.insert(code.end(), {0xff, 0xd0});
+    }
+    // jumps with a 32 bit displacement, returning where to patch it
+    size_t jcc(cc_t cc)
+    {
+        code.insert(code.end(), {0x0f, static_cast<uint8_t>(0x80 | cc)});
+        imm32(0);
+        return code.size() - 4;
+    }
+    size_t jmp()
+    {
+        byte(0xe9);
+        imm32(0);
+        return code.size() - 4;
+    }
+    void patch(size_t at, size_t target)
+    {
+        int32_t rel = target - (at + 4);
+        std::memcpy(&code[at], &rel, sizeof(rel));
+    }
+};
+
+static void write_barrier_of(heapval_t *obj, void *val)
+{
+    write_barrier(obj, val);
+}
+
+static void out_of_bounds(heapval_t *array, int64_t index)
+{
+    array_index_out_of_bounds(array, index);
+}
+
+// Template compiler: each instruction is translated on its own into a fixed sequence of
+// machine instructions. `rbx` holds the locals of the frame and `r12` the context of the
+// interpreter. The depth of the operand stack before each instruction is known from the
+// verifier, so every stack slot is at a fixed offset from `rbx`, and the top of the stack
+// is kept in `rax` between instructions, until a branch, a call or an instruction left to
+// the interpreter needs the whole stack in the frame.
+struct compiler_t {
+    const bc_compiler::method_layout_t &method;
+    const runtime_t &runtime;
+    assembler_t a;
+    // offset of the operand stack in the frame
+    long base;
+    long depth = 0;
+    bool cached = false; // whether the top of the stack is in rax rather than in its slot
+    compiler_t(const bc_compiler::method_layout_t &method, const runtime_t &runtime)
+      : method(method), runtime(runtime)
+    {
+        base = 1 + method.args.size() + method.locals.size();
+    }
+    int32_t slot(long d)
+    {
+        return (base + d) * sizeof(void *);
+    }
+    int32_t local(long l)
+    {
+        return l * sizeof(void *);
+    }
+    void flush()
+    {
+        if (cached) {
+            a.store(rbx, slot(depth - 1), rax);
+            cached = false;
+        }
+    }
+    void top()
+    {
+        if (!cached) {
+            a.load(rax, rbx, slot(depth - 1));
+        }
+    }
+    // calls `helper` on the encoded instruction #pc
+    void call_helper(helper_t helper, size_t pc)
+    {
+        flush();
+        a.mov(rdi, r12);
+        a.mov_imm(rsi, &method.code[method.code_offsets[pc]]);
+        a.mem({0x8d}, rdx, rbx, slot(depth));
+        a.call(reinterpret_cast<const void *>(helper));
+    }
+    // exits through out_of_bounds unless the array in `array` has an element `index`
+    void bounds_check(int array, int index)
+    {
+        a.mem({0x3b}, index, array, offsetof(heapval_t, size));
+        auto ok = a.jcc(cc_b);
+        a.mov(rdi, array);
+        a.mov(rsi, index);
+        a.call(reinterpret_cast<const void *>(out_of_bounds));
+        a.patch(ok, a.code.size());
+    }
+    void ret()
+    {
+        auto fp_addr = &fp;
+        // pop the frame and push the result on the operand stack of the caller
+        a.mov_imm(rcx, fp_addr);
+        a.load(rdx, rcx, 0);
+        a.ri8(5, rdx, sizeof(frame_t));
+        a.store(rcx, 0, rdx);
+        a.load(rcx, rdx, offsetof(frame_t, sp));
+        a.store(rcx, 0, rax);
+        a.ri8(0, rcx, sizeof(void *));
+        a.store(rdx, offsetof(frame_t, sp), rcx);
+        // the caller goes past its call
+        a.mem({0x83}, 0, rdx, offsetof(frame_t, ip));
+        a.byte(bytecode::encoded_size(op_code_t::invoke_));
+        a.pop(r13);
+        a.pop(r12);
+        a.pop(rbx);
+        a.byte(0xc3);
+    }
+    bool compile(compiled_method_t &compiled);
+};
+
+bool compiler_t::compile(compiled_method_t &compiled)
+{
+    auto &code = method.instructions;
+    auto depths = bc_compiler::stack_depths(method);
+    std::vector<bool> targets(code.size());
+    targets[0] = true;
+    for (auto &i : code) {
+        if (i.is_branch()) {
+            targets[i.operand] = true;
+        }
+    }
+    std::vector<size_t> native(code.size());
+    std::vector<std::pair<size_t, long>> branches; // jumps to patch, with their target
+    auto branch = [&](size_t at, long target) { branches.emplace_back(at, target); };
+    // the frame is aligned on 16 bytes for the calls to the helpers
+    a.push(rbx);
+    a.push(r12);
+    a.push(r13);
+    a.mov(rbx, rdi);
+    a.mov(r12, rsi);
+    a.code.insert(a.code.end(), {0xff, 0xe2}); // jmp rdx
+    for (size_t pc = 0; pc < code.size(); ++pc) {
+        auto &i = code[pc];
+        if (depths[pc] == -1) {
+            cached = false;
+            continue;
+        }
+        // the top of the stack can only be cached when falling through to `pc`
+        depth = depths[pc];
+        if (targets[pc]) {
+            flush();
+        }
+        native[pc] = a.code.size();
+        switch (i.op_code) {
+        case op_code_t::band_:
+            top();
+            a.mem({0x23}, rax, rbx, slot(depth - 2));
+            cached = true;
+            break;
+        case op_code_t::bneg_:
+            top();
+            a.rr({0x85}, rax, rax);
+            a.setcc(cc_e);
+            cached = true;
+            break;
+        case op_code_t::getfield_:
+            top();
+            a.load(rax, rax, sizeof(heapval_t) + i.operand * sizeof(int64_t));
+            cached = true;
+            break;
+        case op_code_t::goto_:
+            flush();
+            branch(a.jmp(), i.operand);
+            break;
+        case op_code_t::goto_if_false_:
+            top();
+            cached = false;
+            a.rr({0x85}, rax, rax);
+            branch(a.jcc(cc_e), i.operand);
+            break;
+        case op_code_t::guard_class_:
+            flush();
+            a.load(rcx, rbx, local(i.operand2));
+            a.load(rcx, rcx, offsetof(heapval_t, vtable));
+            a.ri8(4, rcx, ~TAG_MASK);
+            a.mov_imm(rdx, (*runtime.classes)[i.operand3].info);
+            a.rr({0x39}, rdx, rcx);
+            branch(a.jcc(cc_ne), i.operand);
+            break;
+        case op_code_t::iadd_:
+            top();
+            a.mem({0x03}, rax, rbx, slot(depth - 2));
+            cached = true;
+            break;
+        case op_code_t::iaload_:
+        case op_code_t::iaload_nc_:
+            top();
+            a.load(rcx, rbx, slot(depth - 2));
+            if (i.op_code == op_code_t::iaload_) {
+                bounds_check(rax, rcx);
+            }
+            a.element(0x8b, rax, rax, rcx);
+            cached = true;
+            break;
+        case op_code_t::iastore_:
+        case op_code_t::iastore_nc_:
+            top();
+            a.load(rcx, rbx, slot(depth - 3));
+            a.load(rdx, rbx, slot(depth - 2));
+            if (i.op_code == op_code_t::iastore_) {
+                bounds_check(rax, rcx);
+            }
+            a.element(0x89, rdx, rax, rcx);
+            cached = false;
+            break;
+        case op_code_t::if_false_:
+        case op_code_t::if_true_:
+            flush();
+            a.mem({0x83}, 7, rbx, local(i.operand2));
+            a.byte(0);
+            branch(a.jcc(i.op_code == op_code_t::if_false_ ? cc_e : cc_ne), i.operand);
+            break;
+        case op_code_t::if_ige_:
+        case op_code_t::if_ilt_:
+            top();
+            cached = false;
+            a.load(rcx, rbx, slot(depth - 2));
+            a.rr({0x39}, rax, rcx);
+            branch(a.jcc(i.op_code == op_code_t::if_ige_ ? cc_ge : cc_l), i.operand);
+            break;
+        case op_code_t::ilt_:
+            top();
+            a.load(rcx, rbx, slot(depth - 2));
+            a.rr({0x39}, rax, rcx);
+            a.setcc(cc_l);
+            cached = true;
+            break;
+        case op_code_t::imul_:
+            top();
+            a.mem({0x0f, 0xaf}, rax, rbx, slot(depth - 2));
+            cached = true;
+            break;
+        case op_code_t::invoke_:
+        case op_code_t::invoke_direct_: call_helper(runtime.invoke, pc); break;
+        case op_code_t::isub_:
+            top();
+            a.load(rcx, rbx, slot(depth - 2));
+            a.rr({0x29}, rax, rcx);
+            a.mov(rax, rcx);
+            cached = true;
+            break;
+        case op_code_t::load_:
+            flush();
+            a.load(rax, rbx, local(i.operand));
+            cached = true;
+            break;
+        case op_code_t::load_getfield_:
+        case op_code_t::load_ldc_iadd_:
+        case op_code_t::load_ldc_isub_:
+        case op_code_t::load_load_:
+        case op_code_t::load_load_if_ige_: return false;
+        case op_code_t::ldc_:
+            flush();
+            a.mov_imm(rax, i.operand);
+            cached = true;
+            break;
+        case op_code_t::length_:
+            top();
+            a.load(rax, rax, offsetof(heapval_t, size));
+            cached = true;
+            break;
+        case op_code_t::putfield_: {
+            top();
+            a.load(rcx, rbx, slot(depth - 2));
+            a.store(rax, sizeof(heapval_t) + i.operand * sizeof(int64_t), rcx);
+            // only a young value can need the write barrier
+            a.mov_imm(rdx, &nursery_start);
+            a.mem({0x3b}, rcx, rdx, 0);
+            auto old = a.jcc(cc_b);
+            a.mov_imm(rdx, &nursery_end);
+            a.mem({0x3b}, rcx, rdx, 0);
+            auto old2 = a.jcc(cc_ae);
+            a.mov(rdi, rax);
+            a.mov(rsi, rcx);
+            a.call(reinterpret_cast<const void *>(write_barrier_of));
+            a.patch(old, a.code.size());
+            a.patch(old2, a.code.size());
+            cached = false;
+            break;
+        }
+        case op_code_t::return_:
+            top();
+            cached = false;
+            ret();
+            break;
+        case op_code_t::store_:
+            top();
+            a.store(rbx, local(i.operand), rax);
+            cached = false;
+            break;
+        // allocations and print_
+        default: call_helper(runtime.exec, pc); break;
+        }
+    }
+    for (auto &b : branches) {
+        a.patch(b.first, native[b.second]);
+    }
+    // writable then executable pages, never both
+    auto size = a.code.size();
+    auto p =
+        mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) {
+        return false;
+    }
+    std::memcpy(p, a.code.data(), size);
+    if (mprotect(p, size, PROT_READ | PROT_EXEC) != 0) {
+        munmap(p, size);
+        return false;
+    }
+    auto start = static_cast<uint8_t *>(p);
+    compiled.code = reinterpret_cast<code_t>(start);
+    compiled.entries.assign(method.code.size(), nullptr);
+    for (size_t pc = 0; pc < code.size(); ++pc) {
+        if (targets[pc] && depths[pc] != -1) {
+            compiled.entries[method.code_offsets[pc]] = start + native[pc];
+        }
+    }
+    return true;
+}
+
+bool compile(const bc_compiler::method_layout_t &method, const runtime_t &runtime,
+             compiled_method_t &compiled)
+{
+    compiler_t compiler{method, runtime};
+    return compiler.compile(compiled);
+}
+
+} // namespace jit
+
+#endif // HAVE_JIT
@@ -0,0 +1,401 @@
+#include <algorithm>
+#include <iostream>
+
+#include <bytecode.h>
+
+// ============================================================================
+// Register bytecode compiler
+// ============================================================================
+
+namespace bc_compiler {
+
+using bytecode::op_code_t;
+using bytecode::reg_instruction_t;
+using bytecode::reg_op_code_t;
+
+// An operand stack entry during the translation: either a register holding the value
+// or a constant which has not been materialized yet.
+struct operand_t {
+    bool is_const;
+    long value;
+};
+
+struct reg_compiler_t {
+    method_layout_t &method;
+    long nlocals; // `this`, arguments and locals
+    std::vector<long> depth; // stack depth before each instruction, -1 if unreachable
+    std::vector<std::vector<bool>> refs; // reference slots before each instruction
+    std::vector<bool> leader; // whether an instruction is a branch target
+    std::vector<operand_t> stack;
+    std::vector<reg_instruction_t> code;
+    std::vector<size_t> reg_pc; // first register instruction of each stack instruction
+    std::vector<size_t> fixups; // register instructions whose target is a stack pc
+    std::vector<std::vector<int32_t>> stack_maps; // by register instruction
+    long last_result; // register instruction which produced the stack top, or -1
+    long max_reg;
+    reg_compiler_t(method_layout_t &method)
+      : method(method),
+        nlocals(1 + method.args.size() + method.locals.size()),
+        leader(method.instructions.size(), false),
+        reg_pc(method.instructions.size() + 1, 0),
+        last_result(-1),
+        max_reg(nlocals - 1)
+    {
+    }
+    long temp(size_t d)
+    {
+        max_reg = std::max(max_reg, static_cast<long>(nlocals + d));
+        return nlocals + d;
+    }
+    void emit(reg_op_code_t op, long a = 0, long b = 0, long c = 0)
+    {
+        code.push_back(reg_instruction_t{op, a, b, c});
+        last_result = -1;
+    }
+    // emit an instruction writing its result into the temporary of a new stack top
+    void emit_result(reg_op_code_t op, long b = 0, long c = 0)
+    {
+        auto d = temp(stack.size());
+        emit(op, d, b, c);
+        stack.push_back(operand_t{false, d});
+        last_result = code.size() - 1;
+    }
+    // move the entry at depth d into its own temporary
+    void materialize(size_t d)
+    {
+        auto &e = stack.at(d);
+        auto t = temp(d);
+        if (e.is_const) {
+            emit(reg_op_code_t::ldc_, t, e.value);
+        }
+        else if (e.value != t) {
+            emit(reg_op_code_t::mov_, t, e.value);
+        }
+        e = operand_t{false, t};
+    }
+    // the register holding the entry at depth d
+    long reg(size_t d)
+    {
+        if (stack.at(d).is_const) {
+            materialize(d);
+        }
+        return stack.at(d).value;
+    }
+    void flush()
+    {
+        for (size_t d = 0; d < stack.size(); ++d) {
+            materialize(d);
+        }
+    }
+    // entries still referring to a local must be saved before the local is overwritten
+    void spill_uses(long r)
+    {
+        for (size_t d = 0; d < stack.size(); ++d) {
+            if (!stack[d].is_const && stack[d].value == r) {
+                materialize(d);
+            }
+        }
+    }
+    // Record the reference registers for the next instruction, a safepoint of the stack
+    // instruction at pc whose operands were popped. Temporaries only hold the entry of
+    // their depth when it was materialized, otherwise they are dead.
+    void stack_map(size_t pc)
+    {
+        std::vector<int32_t> map;
+        for (long r = 0; r < nlocals; ++r) {
+            if (method.local_refs[r]) {
+                map.push_back(r);
+            }
+        }
+        for (size_t d = 0; d < stack.size(); ++d) {
+            long t = nlocals + d;
+            if (refs[pc][d] && !stack[d].is_const && stack[d].value == t) {
+                map.push_back(t);
+            }
+        }
+        stack_maps.resize(code.size() + 1);
+        stack_maps[code.size()] = std::move(map);
+    }
+    void emit_jump(reg_op_code_t op, long a, long b, long c)
+    {
+        emit(op, a, b, c);
+        fixups.push_back(code.size() - 1);
+    }
+    void compute_depths();
+    void binary(reg_op_code_t op, reg_op_code_t opk);
+    void compile();
+};
+
+void reg_compiler_t::compute_depths()
+{
+    auto &instructions = method.instructions;
+    depth = stack_depths(method);
+    refs = stack_refs(method);
+    for (size_t pc = 0; pc < instructions.size(); ++pc) {
+        auto &i = instructions[pc];
+        if (depth[pc] != -1 && i.is_branch()) {
+            leader.at(i.operand) = true;
+        }
+    }
+}
+
+void reg_compiler_t::binary(reg_op_code_t op, reg_op_code_t opk)
+{
+    auto d = stack.size() - 2;
+    auto lhs = stack[d];
+    auto rhs = stack[d + 1];
+    if (lhs.is_const && rhs.is_const) {
+        long r = 0;
+        switch (op) {
+        case reg_op_code_t::band_: r = lhs.value & rhs.value; break;
+        case reg_op_code_t::iadd_: r = lhs.value + rhs.value; break;
+        case reg_op_code_t::ilt_: r = lhs.value < rhs.value ? 1 : 0; break;
+        case reg_op_code_t::imul_: r = lhs.value * rhs.value; break;
+        case reg_op_code_t::isub_: r = lhs.value - rhs.value; break;
+        default: assert(false);
+        }
+        stack.resize(d);
+        stack.push_back(operand_t{true, r});
+        return;
+    }
+    if (rhs.is_const && opk != op) {
+        auto b = reg(d);
+        stack.resize(d);
+        emit_result(opk, b, rhs.value);
+        return;
+    }
+    auto b = reg(d);
+    auto c = reg(d + 1);
+    stack.resize(d);
+    emit_result(op, b, c);
+}
+
+void reg_compiler_t::compile()
+{
+    auto &instructions = method.instructions;
+    compute_depths();
+    bool fallthrough = true;
+    for (size_t pc = 0; pc < instructions.size(); ++pc) {
+        if (depth[pc] == -1) {
+            // unreachable
+            reg_pc[pc] = code.size();
+            continue;
+        }
+        if (leader[pc]) {
+            if (fallthrough) {
+                flush();
+            }
+            stack.clear();
+            for (long d = 0; d < depth[pc]; ++d) {
+                stack.push_back(operand_t{false, temp(d)});
+            }
+            last_result = -1;
+        }
+        reg_pc[pc] = code.size();
+        fallthrough = true;
+        auto &i = instructions[pc];
+        switch (i.op_code) {
+        case op_code_t::band_: binary(reg_op_code_t::band_, reg_op_code_t::band_); break;
+        case op_code_t::bneg_: {
+            auto d = stack.size() - 1;
+            if (stack[d].is_const) {
+                stack[d].value = !stack[d].value;
+                break;
+            }
+            auto b = reg(d);
+            stack.pop_back();
+            emit_result(reg_op_code_t::bneg_, b);
+            break;
+        }
+        case op_code_t::getfield_: {
+            auto b = reg(stack.size() - 1);
+            stack.pop_back();
+            emit_result(reg_op_code_t::getfield_, b, i.operand);
+            break;
+        }
+        case op_code_t::goto_:
+            flush();
+            emit_jump(reg_op_code_t::jmp_, i.operand, 0, 0);
+            fallthrough = false;
+            break;
+        case op_code_t::goto_if_false_: {
+            auto a = reg(stack.size() - 1);
+            stack.pop_back();
+            flush();
+            emit_jump(reg_op_code_t::jf_, a, i.operand, 0);
+            break;
+        }
+        case op_code_t::guard_class_:
+            flush();
+            emit_jump(reg_op_code_t::guard_class_, i.operand2, i.operand3, i.operand);
+            break;
+        case op_code_t::iadd_: binary(reg_op_code_t::iadd_, reg_op_code_t::iaddk_); break;
+        case op_code_t::iaload_:
+        case op_code_t::iaload_nc_: {
+            auto d = stack.size() - 2;
+            auto c = reg(d);
+            auto b = reg(d + 1);
+            stack.resize(d);
+            emit_result(i.op_code == op_code_t::iaload_ ? reg_op_code_t::iaload_
+                                                        : reg_op_code_t::iaload_nc_,
+                        b, c);
+            break;
+        }
+        case op_code_t::iastore_:
+        case op_code_t::iastore_nc_: {
+            auto d = stack.size() - 3;
+            auto b = reg(d);
+            auto c = reg(d + 1);
+            auto a = reg(d + 2);
+            stack.resize(d);
+            emit(i.op_code == op_code_t::iastore_ ? reg_op_code_t::iastore_
+                                                  : reg_op_code_t::iastore_nc_,
+                 a, b, c);
+            break;
+        }
+        case op_code_t::if_false_:
+        case op_code_t::if_true_: {
+            auto false_ = i.op_code == op_code_t::if_false_;
+            auto op = false_ ? reg_op_code_t::jf_ : reg_op_code_t::jt_;
+            flush();
+            emit_jump(op, i.operand2, i.operand, 0);
+            break;
+        }
+        case op_code_t::if_ige_:
+        case op_code_t::if_ilt_: {
+            auto d = stack.size() - 2;
+            auto a = reg(d);
+            auto b = reg(d + 1);
+            stack.resize(d);
+            flush();
+            emit_jump(i.op_code == op_code_t::if_ige_ ? reg_op_code_t::ilt_jf_
+                                                      : reg_op_code_t::ilt_jt_,
+                      a, b, i.operand);
+            break;
+        }
+        case op_code_t::ilt_:
+            // fuse the comparison with the conditional branch consuming it
+            if (pc + 1 < instructions.size() && !leader[pc + 1] &&
+                instructions[pc + 1].op_code == op_code_t::goto_if_false_) {
+                auto d = stack.size() - 2;
+                auto a = reg(d);
+                auto b = reg(d + 1);
+                stack.resize(d);
+                flush();
+                emit_jump(reg_op_code_t::ilt_jf_, a, b, instructions[pc + 1].operand);
+                reg_pc[++pc] = code.size() - 1;
+                break;
+            }
+            binary(reg_op_code_t::ilt_, reg_op_code_t::ilt_);
+            break;
+        case op_code_t::imul_: binary(reg_op_code_t::imul_, reg_op_code_t::imul_); break;
+        case op_code_t::invoke_:
+        case op_code_t::invoke_direct_: {
+            auto base = stack.size() - i.operand2;
+            for (auto d = base; d < stack.size(); ++d) {
+                materialize(d);
+            }
+            stack.resize(base);
+            stack_map(pc);
+            auto op = i.op_code == op_code_t::invoke_ ? reg_op_code_t::invoke_
+                                                      : reg_op_code_t::invoke_direct_;
+            emit(op, temp(base), i.operand, i.operand2);
+            stack.push_back(operand_t{false, temp(base)});
+            break;
+        }
+        case op_code_t::isub_: binary(reg_op_code_t::isub_, reg_op_code_t::isubk_); break;
+        case op_code_t::load_: stack.push_back(operand_t{false, i.operand}); break;
+        case op_code_t::ldc_: stack.push_back(operand_t{true, i.operand}); break;
+        case op_code_t::length_: {
+            auto b = reg(stack.size() - 1);
+            stack.pop_back();
+            emit_result(reg_op_code_t::length_, b);
+            break;
+        }
+        case op_code_t::new_:
+            stack_map(pc);
+            emit_result(reg_op_code_t::new_, i.operand);
+            break;
+        case op_code_t::newarray_: {
+            auto b = reg(stack.size() - 1);
+            stack.pop_back();
+            stack_map(pc);
+            emit_result(reg_op_code_t::newarray_, b);
+            break;
+        }
+        case op_code_t::putfield_: {
+            auto d = stack.size() - 2;
+            auto c = reg(d);
+            auto a = reg(d + 1);
+            stack.resize(d);
+            emit(reg_op_code_t::putfield_, a, i.operand, c);
+            break;
+        }
+        case op_code_t::print_: {
+            auto a = reg(stack.size() - 1);
+            stack.pop_back();
+            emit(reg_op_code_t::print_, a);
+            break;
+        }
+        case op_code_t::return_:
+            if (stack.empty()) {
+                emit(reg_op_code_t::return_, -1);
+            }
+            else {
+                auto a = reg(stack.size() - 1);
+                stack.pop_back();
+                emit(reg_op_code_t::return_, a);
+            }
+            fallthrough = false;
+            break;
+        case op_code_t::store_: {
+            auto x = i.operand;
+            auto e = stack.back();
+            // write the result of the instruction producing the value directly into x
+            auto retarget = !e.is_const && last_result >= 0 &&
+                            last_result == static_cast<long>(code.size()) - 1 &&
+                            code.back().a == e.value;
+            stack.pop_back();
+            auto n = code.size();
+            spill_uses(x);
+            if (retarget && code.size() == n) {
+                code.back().a = x;
+            }
+            else if (e.is_const) {
+                emit(reg_op_code_t::ldc_, x, e.value);
+            }
+            else if (e.value != x) {
+                emit(reg_op_code_t::mov_, x, e.value);
+            }
+            last_result = -1;
+            break;
+        }
+        default: std::cerr << "Unknown op code" << std::endl; exit(1);
+        }
+    }
+    reg_pc[instructions.size()] = code.size();
+    for (auto f : fixups) {
+        auto &ri = code[f];
+        switch (ri.op_code) {
+        case reg_op_code_t::jmp_: ri.a = reg_pc.at(ri.a); break;
+        case reg_op_code_t::jf_:
+        case reg_op_code_t::jt_: ri.b = reg_pc.at(ri.b); break;
+        case reg_op_code_t::guard_class_:
+        case reg_op_code_t::ilt_jf_:
+        case reg_op_code_t::ilt_jt_: ri.c = reg_pc.at(ri.c); break;
+        default: assert(false);
+        }
+    }
+    stack_maps.resize(code.size());
+    method.reg_instructions = std::move(code);
+    method.reg_stack_maps = std::move(stack_maps);
+    method.nregs = max_reg + 1;
+}
+
+void compile_registers(method_layout_t &method)
+{
+    reg_compiler_t compiler{method};
+    compiler.compile();
+}
+
+} // namespace bc_compiler
@@ -12,15 +12,46 @@ integer_t *integer_type = new integer_t();
 boolean_t *boolean_type = new boolean_t();
 array_t *array_type = new array_t();
 
+// the subclasses of a class are numbered right after it
 bool class_symtbl_t::is_subtype(class_symtbl_t *other)
 {
-    if (this == other) {
-        return true;
+    return other->preorder <= preorder && preorder <= other->last_descendant;
+}
+
+static void number_subtree(class_symtbl_t *c,
+                           std::map<std::string, std::vector<class_symtbl_t *>> &subclasses,
+                           size_t &next)
+{
+    c->preorder = next++;
+    for (auto subclass : subclasses[c->name]) {
+        number_subtree(subclass, subclasses, next);
+    }
+    c->last_descendant = next - 1;
+}
+
+// Numbers the classes in a preorder walk of the hierarchy, so that a class is a subclass of
+// another when its number falls within the interval of the other. The numbers start at 1,
+// the classes left at 0 are on an inheritance cycle.
+void symtbl_t::number_classes()
+{
+    std::map<std::string, std::vector<class_symtbl_t *>> subclasses;
+    for (auto &[name, c] : classes) {
+        if (c->parent_class != nullptr) {
+            subclasses[c->parent_class->name].push_back(c);
+        }
     }
-    if (parent_class == nullptr) {
-        return false;
+    size_t next = 1;
+    for (auto &[name, c] : classes) {
+        if (c->parent_class == nullptr) {
+            number_subtree(c, subclasses, next);
+        }
+    }
+    for (auto &[name, c] : classes) {
+        if (c->preorder == 0) {
+            std::cerr << "Class " << name << " inherits from itself" << std::endl;
+            exit(1);
+        }
     }
-    return parent_class->is_subtype(other);
 }
 
 type_t *symtbl_t::str_to_type(const std::string &name)
@@ -78,6 +109,7 @@ void semantic_vis_accum_parent_classes_t::visit(parser::goal_t *node)
     for (auto &class_decl : node->class_decls) {
         class_decl->accept(this);
     }
+    symtbl->number_classes();
 }
 
 void semantic_vis_accum_parent_classes_t::visit(parser::class_decl_t *node)
@@ -184,6 +216,35 @@ void semantic_vis_type_check_t::visit(parser::method_decl_t *node)
         std::cerr << "Method not found" << std::endl;
         exit(1);
     }
+    // the bytecode and the stack maps take the types of a call from the method of the
+    // static class of the receiver, which an overriding method must keep; the nearest one
+    // overridden was itself checked against those it overrides
+    auto overridden = [&]() -> method_symtbl_t * {
+        auto c = context.current_class->parent_class;
+        for (; c != nullptr; c = c->parent_class) {
+            for (auto m : c->methods) {
+                if (m->name == context.current_method->name) {
+                    return m;
+                }
+            }
+        }
+        return nullptr;
+    }();
+    if (overridden != nullptr) {
+        auto &params = context.current_method->params;
+        auto same_types = params.size() == overridden->params.size() &&
+                          context.current_method->return_type == overridden->return_type;
+        for (size_t i = 0; same_types && i < params.size(); i++) {
+            same_types = params.at(i).second == overridden->params.at(i).second;
+        }
+        if (!same_types) {
+            std::cerr << "Method " << context.current_method->name
+                      << " must keep the argument and return types of the method it "
+                         "overrides"
+                      << std::endl;
+            exit(1);
+        }
+    }
     for (auto &statement : node->statements) {
         statement->accept(this);
     }
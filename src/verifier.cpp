@@ -0,0 +1,576 @@
+#include <algorithm>
+#include <iostream>
+#include <unordered_map>
+
+#include <bytecode.h>
+
+// ============================================================================
+// Bytecode verifier
+// ============================================================================
+
+namespace bc_compiler {
+
+using bytecode::op_code_t;
+
+static void verify_error(const method_layout_t &method, size_t pc, const std::string &msg)
+{
+    std::cerr << "error: " << method.method_name.first << "." << method.method_name.second
+              << ": " << msg << " at instruction " << pc << std::endl;
+    exit(1);
+}
+
+std::vector<size_t> successors(const bytecode::instruction_t &i, size_t pc)
+{
+    switch (i.op_code) {
+    case op_code_t::goto_: return {static_cast<size_t>(i.operand)};
+    case op_code_t::return_: return {};
+    default:
+        if (i.is_branch()) {
+            return {static_cast<size_t>(i.operand), pc + 1};
+        }
+        return {pc + 1};
+    }
+}
+
+std::vector<long> stack_depths(const method_layout_t &method)
+{
+    auto &instructions = method.instructions;
+    std::vector<long> depth(instructions.size(), -1);
+    if (instructions.empty()) {
+        verify_error(method, 0, "empty method");
+    }
+    // `main` returns nothing, all other methods return the value on top of their stack
+    long return_depth = method.method_name.second == "main" ? 0 : 1;
+    long nlocals = 1 + method.args.size() + method.locals.size();
+    std::vector<size_t> worklist{0};
+    depth[0] = 0;
+    auto propagate = [&](size_t from, size_t pc, long d) {
+        if (pc >= instructions.size()) {
+            verify_error(method, from, "control flow leaves the method");
+        }
+        if (depth[pc] == -1) {
+            depth[pc] = d;
+            worklist.push_back(pc);
+        }
+        else if (depth[pc] != d) {
+            verify_error(method, pc, "inconsistent stack depth");
+        }
+    };
+    while (!worklist.empty()) {
+        auto pc = worklist.back();
+        worklist.pop_back();
+        auto &i = instructions[pc];
+        switch (i.op_code) {
+        case op_code_t::invoke_:
+        case op_code_t::invoke_direct_:
+            if (i.operand2 < 1) {
+                verify_error(method, pc, "invoke without receiver");
+            }
+            break;
+        case op_code_t::load_:
+        case op_code_t::store_:
+            if (i.operand < 0 || i.operand >= nlocals) {
+                verify_error(method, pc, "local out of range");
+            }
+            break;
+        case op_code_t::guard_class_:
+        case op_code_t::if_false_:
+        case op_code_t::if_true_:
+            if (i.operand2 < 0 || i.operand2 >= nlocals) {
+                verify_error(method, pc, "local out of range");
+            }
+            break;
+        case op_code_t::return_:
+            if (depth[pc] != return_depth) {
+                verify_error(method, pc, "unbalanced stack on return");
+            }
+            continue;
+        default: break;
+        }
+        if (depth[pc] < i.pops()) {
+            verify_error(method, pc, "stack underflow");
+        }
+        auto d = depth[pc] - i.pops() + i.pushes();
+        for (auto next : successors(i, pc)) {
+            propagate(pc, next, d);
+        }
+    }
+    return depth;
+}
+
+std::vector<std::vector<bool>> stack_refs(const method_layout_t &method)
+{
+    auto &instructions = method.instructions;
+    std::vector<std::vector<bool>> refs(instructions.size());
+    std::vector<bool> reached(instructions.size(), false);
+    std::vector<size_t> worklist{0};
+    reached[0] = true;
+    while (!worklist.empty()) {
+        auto pc = worklist.back();
+        worklist.pop_back();
+        auto &i = instructions[pc];
+        if (i.op_code == op_code_t::return_) {
+            continue;
+        }
+        auto after = refs[pc];
+        after.resize(after.size() - i.pops());
+        switch (i.op_code) {
+        case op_code_t::getfield_:
+        case op_code_t::invoke_:
+        case op_code_t::invoke_direct_: after.push_back(i.ref); break;
+        case op_code_t::load_: after.push_back(method.local_refs.at(i.operand)); break;
+        case op_code_t::new_:
+        case op_code_t::newarray_: after.push_back(true); break;
+        default:
+            if (i.pushes() > 0) {
+                after.push_back(false);
+            }
+        }
+        for (auto next : successors(i, pc)) {
+            if (!reached[next]) {
+                reached[next] = true;
+                refs[next] = after;
+                worklist.push_back(next);
+            }
+            else if (refs[next] != after) {
+                verify_error(method, next, "inconsistent stack types");
+            }
+        }
+    }
+    return refs;
+}
+
+// the constant 0 pushed by an ldc_, which is an int as well as the null reference every
+// ref local starts with
+static const long type_zero = -4;
+
+static bool is_ref(long type)
+{
+    return type != type_int && type != type_zero;
+}
+
+static void program_error(const std::string &msg)
+{
+    std::cerr << "error: " << msg << std::endl;
+    exit(1);
+}
+
+// Checks the types of a program: those of its classes and signatures once, then the
+// values of the frames of each method along its control flow, as a data flow analysis
+// where a local or stack slot merging objects of two classes gets their closest common
+// ancestor. Images are only checked here, so nothing read by an engine is left unchecked:
+// the indices of fields, classes, vtable slots and methods, the kind of every value
+// stored, and the ref bits the stack maps are built from.
+struct type_checker_t {
+    const std::vector<class_layout_t> &classes;
+    const std::vector<method_layout_t> &methods;
+    std::vector<long> parents; // -1 for the roots
+    std::vector<std::vector<size_t>> vtables; // method of each slot of each class
+    type_checker_t(const std::vector<class_layout_t> &classes,
+                   const std::vector<method_layout_t> &methods)
+      : classes(classes), methods(methods)
+    {
+    }
+    bool is_class(long type) const
+    {
+        return type >= 0 && type < static_cast<long>(classes.size());
+    }
+    bool is_valid(long type) const
+    {
+        return is_class(type) || type == type_int || type == type_array ||
+               type == type_any_ref;
+    }
+    bool is_subclass(long c, long ancestor) const
+    {
+        return classes[ancestor].interval.contains(classes[c].interval);
+    }
+    // whether a value of type `type` can go where one of type `declared` is expected
+    bool is_assignable(long type, long declared) const
+    {
+        if (type == type_zero) {
+            return true;
+        }
+        switch (declared) {
+        case type_int: return !is_ref(type);
+        case type_any_ref: return is_ref(type);
+        case type_array: return type == type_array;
+        default: return is_class(type) && is_subclass(type, declared);
+        }
+    }
+    // the type of a slot reached with both types, which must be of the same kind unless
+    // one of them is zero
+    long join(long a, long b) const
+    {
+        if (a == b || b == type_zero) {
+            return a;
+        }
+        if (a == type_zero) {
+            return b;
+        }
+        if (!is_ref(a)) {
+            return type_int;
+        }
+        if (is_class(a) && is_class(b)) {
+            for (auto c = a; c != -1; c = parents[c]) {
+                if (is_subclass(b, c)) {
+                    return c;
+                }
+            }
+        }
+        return type_any_ref;
+    }
+    bool same_signature(const method_layout_t &m, const method_layout_t &other) const
+    {
+        return m.args.size() == other.args.size() && m.return_type == other.return_type &&
+               std::equal(m.local_types.begin() + 1,
+                          m.local_types.begin() + 1 + m.args.size(),
+                          other.local_types.begin() + 1);
+    }
+    void check_program();
+    void check_method(const method_layout_t &method) const;
+};
+
+void type_checker_t::check_program()
+{
+    // `main` takes no arguments, but gets locals when calls are inlined into it
+    if (methods.empty() || methods[0].method_name.second != "main" ||
+        !methods[0].args.empty()) {
+        program_error("the program must start with a main method without arguments");
+    }
+    std::unordered_map<std::string, size_t> method_by_name;
+    for (size_t m = 0; m < methods.size(); ++m) {
+        auto &method = methods[m];
+        auto &name = method.method_name;
+        if (m > 0 && name.second == "main") {
+            program_error("method " + name.first + ".main is not the main method");
+        }
+        method_by_name.emplace(name.first + "." + name.second, m);
+        auto nlocals = 1 + method.args.size() + method.locals.size();
+        if (method.local_refs.size() != nlocals || method.local_types.size() != nlocals) {
+            verify_error(method, 0, "wrong number of local types");
+        }
+        for (size_t l = 0; l < nlocals; ++l) {
+            auto type = method.local_types[l];
+            if (!is_valid(type) || method.local_refs[l] != is_ref(type)) {
+                verify_error(method, 0, "bad type of local " + std::to_string(l));
+            }
+        }
+        if (!is_valid(method.return_type) || (m > 0 && !is_class(method.local_types[0]))) {
+            verify_error(method, 0, "bad signature");
+        }
+    }
+    std::unordered_map<std::string, long> class_by_name;
+    for (size_t c = 0; c < classes.size(); ++c) {
+        class_by_name.emplace(classes[c].name, c);
+    }
+    for (size_t c = 0; c < classes.size(); ++c) {
+        auto &cl = classes[c];
+        auto parent = class_by_name.find(cl.parent);
+        parents.push_back(parent == class_by_name.end() ? -1 : parent->second);
+        std::vector<int32_t> ref_fields;
+        for (size_t f = 0; f < cl.field_types.size(); ++f) {
+            if (!is_valid(cl.field_types[f]) || cl.field_types[f] == type_any_ref) {
+                program_error("bad type of field " + std::to_string(f) + " of class " +
+                              cl.name);
+            }
+            if (is_ref(cl.field_types[f])) {
+                ref_fields.push_back(f);
+            }
+        }
+        if (cl.field_types.size() != cl.fields.size() || ref_fields != cl.ref_fields) {
+            program_error("bad fields of class " + cl.name);
+        }
+        vtables.emplace_back();
+        for (auto &name : cl.vtbl) {
+            auto m = method_by_name.find(name.first + "." + name.second);
+            // a vtable slot holds a method of the class or of one of its ancestors, or
+            // `main` for the main class, which no call can reach as it has no `this`
+            if (m == method_by_name.end() ||
+                (m->second != 0 && !is_subclass(c, methods[m->second].local_types[0]))) {
+                program_error("bad method " + name.first + "." + name.second +
+                              " in the vtable of class " + cl.name);
+            }
+            vtables.back().push_back(m->second);
+        }
+    }
+    // a class extends the fields and the vtable of its parent, keeping the signatures of
+    // the methods it overrides, so that the code for the parent works on its objects
+    for (size_t c = 0; c < classes.size(); ++c) {
+        if (parents[c] == -1) {
+            continue;
+        }
+        auto &cl = classes[c];
+        auto &parent = classes[parents[c]];
+        auto &vtable = vtables[c];
+        auto &parent_vtable = vtables[parents[c]];
+        if (cl.field_types.size() < parent.field_types.size() ||
+            !std::equal(parent.field_types.begin(), parent.field_types.end(),
+                        cl.field_types.begin())) {
+            program_error("class " + cl.name + " does not extend the fields of its parent");
+        }
+        if (vtable.size() < parent_vtable.size()) {
+            program_error("class " + cl.name + " does not extend the vtable of its parent");
+        }
+        for (size_t slot = 0; slot < parent_vtable.size(); ++slot) {
+            auto &m = methods[vtable[slot]];
+            auto &overridden = methods[parent_vtable[slot]];
+            if (m.method_name.second != overridden.method_name.second ||
+                !same_signature(m, overridden)) {
+                program_error("method " + m.method_name.first + "." +
+                              m.method_name.second + " does not match the method it "
+                              "overrides");
+            }
+        }
+    }
+}
+
+// types of the locals and of the operand stack before an instruction
+struct frame_types_t {
+    std::vector<long> locals;
+    std::vector<long> stack;
+};
+
+void type_checker_t::check_method(const method_layout_t &method) const
+{
+    auto &instructions = method.instructions;
+    std::vector<frame_types_t> before(instructions.size());
+    std::vector<bool> reached(instructions.size(), false);
+    before[0].locals = method.local_types;
+    reached[0] = true;
+    std::vector<size_t> worklist{0};
+    while (!worklist.empty()) {
+        auto pc = worklist.back();
+        worklist.pop_back();
+        auto &i = instructions[pc];
+        auto frame = before[pc];
+        auto &stack = frame.stack;
+        auto error = [&](const std::string &msg) { verify_error(method, pc, msg); };
+        auto pop = [&](long declared) {
+            auto type = stack.back();
+            stack.pop_back();
+            if (!is_assignable(type, declared)) {
+                error("operand of the wrong type");
+            }
+            return type;
+        };
+        auto pop_object = [&]() {
+            auto type = stack.back();
+            stack.pop_back();
+            if (!is_class(type)) {
+                error("object of a known class expected");
+            }
+            return type;
+        };
+        auto check_class = [&](long c) {
+            if (!is_class(c)) {
+                error("class out of range");
+            }
+        };
+        // the receiver and the arguments on the stack are those of the callee
+        auto call = [&](size_t callee) {
+            auto &m = methods[callee];
+            auto nargs = static_cast<size_t>(i.operand2);
+            if (nargs != 1 + m.args.size()) {
+                error("wrong number of arguments");
+            }
+            auto base = stack.size() - nargs;
+            for (size_t a = 0; a < nargs; ++a) {
+                if (!is_assignable(stack[base + a], m.local_types[a])) {
+                    error("argument " + std::to_string(a) + " of the wrong type");
+                }
+            }
+            if (i.ref != is_ref(m.return_type)) {
+                error("wrong ref bit");
+            }
+            stack.resize(base);
+            stack.push_back(m.return_type);
+        };
+        switch (i.op_code) {
+        case op_code_t::band_:
+        case op_code_t::iadd_:
+        case op_code_t::ilt_:
+        case op_code_t::imul_:
+        case op_code_t::isub_:
+            pop(type_int);
+            pop(type_int);
+            stack.push_back(type_int);
+            break;
+        case op_code_t::bneg_:
+            pop(type_int);
+            stack.push_back(type_int);
+            break;
+        case op_code_t::getfield_:
+        case op_code_t::putfield_: {
+            auto &cl = classes[pop_object()];
+            if (i.operand < 0 || i.operand >= static_cast<long>(cl.field_types.size())) {
+                error("field out of range");
+            }
+            auto type = cl.field_types[i.operand];
+            if (i.op_code == op_code_t::putfield_) {
+                pop(type);
+                break;
+            }
+            if (i.ref != is_ref(type)) {
+                error("wrong ref bit");
+            }
+            stack.push_back(type);
+            break;
+        }
+        case op_code_t::goto_: break;
+        case op_code_t::goto_if_false_:
+        case op_code_t::print_: pop(type_int); break;
+        case op_code_t::guard_class_:
+            check_class(i.operand3);
+            if (frame.locals[i.operand2] == type_int) {
+                error("guard on a local holding an int");
+            }
+            break;
+        case op_code_t::iaload_:
+            pop(type_array);
+            pop(type_int);
+            stack.push_back(type_int);
+            break;
+        case op_code_t::iastore_:
+            pop(type_array);
+            pop(type_int);
+            pop(type_int);
+            break;
+        case op_code_t::if_false_:
+        case op_code_t::if_true_:
+            if (is_ref(frame.locals[i.operand2])) {
+                error("test of a local holding a reference");
+            }
+            break;
+        case op_code_t::if_ige_:
+        case op_code_t::if_ilt_:
+            pop(type_int);
+            pop(type_int);
+            break;
+        case op_code_t::invoke_: {
+            check_class(i.operand3);
+            auto receiver = stack[stack.size() - i.operand2];
+            if (receiver == type_zero) {
+                receiver = i.operand3;
+            }
+            if (!is_class(receiver) || !is_subclass(receiver, i.operand3)) {
+                error("receiver of the wrong type");
+            }
+            auto &vtable = vtables[receiver];
+            if (i.operand < 0 || i.operand >= static_cast<long>(vtable.size())) {
+                error("vtable slot out of range");
+            }
+            call(vtable[i.operand]);
+            break;
+        }
+        case op_code_t::invoke_direct_: {
+            check_class(i.operand3);
+            if (i.operand <= 0 || i.operand >= static_cast<long>(methods.size())) {
+                error("method out of range");
+            }
+            // the receiver is an instance of the class the call was devirtualized for
+            auto receiver = stack[stack.size() - i.operand2];
+            if (receiver != type_zero &&
+                (!is_class(receiver) || !is_subclass(receiver, i.operand3))) {
+                error("receiver of the wrong type");
+            }
+            call(i.operand);
+            break;
+        }
+        case op_code_t::load_: stack.push_back(frame.locals[i.operand]); break;
+        case op_code_t::ldc_: stack.push_back(i.operand == 0 ? type_zero : type_int); break;
+        case op_code_t::length_:
+            pop(type_array);
+            stack.push_back(type_int);
+            break;
+        case op_code_t::new_:
+            check_class(i.operand);
+            stack.push_back(i.operand);
+            break;
+        case op_code_t::newarray_:
+            pop(type_int);
+            stack.push_back(type_array);
+            break;
+        case op_code_t::return_:
+            if (&method != &methods[0]) {
+                pop(method.return_type);
+            }
+            continue;
+        case op_code_t::store_: {
+            // the local keeps the type of the value, zero included, for the loads below
+            frame.locals[i.operand] = pop(method.local_types[i.operand]);
+            break;
+        }
+        default: error("unexpected " + i.as_str());
+        }
+        for (auto next : successors(i, pc)) {
+            auto &merged = before[next];
+            if (!reached[next]) {
+                reached[next] = true;
+                merged = frame;
+                worklist.push_back(next);
+                continue;
+            }
+            auto changed = false;
+            auto merge = [&](long &slot, long type) {
+                if (slot != type_zero && type != type_zero &&
+                    is_ref(slot) != is_ref(type)) {
+                    verify_error(method, next, "inconsistent stack types");
+                }
+                auto joined = join(slot, type);
+                changed |= joined != slot;
+                slot = joined;
+            };
+            for (size_t l = 0; l < merged.locals.size(); ++l) {
+                merge(merged.locals[l], frame.locals[l]);
+            }
+            for (size_t d = 0; d < merged.stack.size(); ++d) {
+                merge(merged.stack[d], frame.stack[d]);
+            }
+            if (changed) {
+                worklist.push_back(next);
+            }
+        }
+    }
+}
+
+static void verify(method_layout_t &method, const type_checker_t &checker)
+{
+    auto depth = stack_depths(method);
+    checker.check_method(method);
+    // every instruction but `return` has a successor, whose depth is the one after it
+    method.max_stack = *std::max_element(depth.begin(), depth.end());
+    // at a safepoint, the live operand slots are the ones below the operands of the
+    // instruction, which were popped (or became the arguments of the callee)
+    auto refs = stack_refs(method);
+    long nlocals = method.local_refs.size();
+    method.stack_maps.assign(method.instructions.size(), {});
+    for (size_t pc = 0; pc < method.instructions.size(); ++pc) {
+        auto &i = method.instructions[pc];
+        if (depth[pc] == -1 || !i.is_safepoint()) {
+            continue;
+        }
+        auto &map = method.stack_maps[pc];
+        for (long slot = 0; slot < nlocals; ++slot) {
+            if (method.local_refs[slot]) {
+                map.push_back(slot);
+            }
+        }
+        for (long d = 0; d < depth[pc] - i.pops(); ++d) {
+            if (refs[pc][d]) {
+                map.push_back(nlocals + d);
+            }
+        }
+    }
+}
+
+void verify(const std::vector<class_layout_t> &classes,
+            std::vector<method_layout_t> &methods)
+{
+    type_checker_t checker{classes, methods};
+    checker.check_program();
+    for (auto &method : methods) {
+        verify(method, checker);
+    }
+}
+
+} // namespace bc_compiler
@@ -7,11 +7,42 @@ cd build
 cmake ..
 make -j
 
-# 2. Run the tests and check if at least one test failed
+# 2. Run the tests on every engine and check if at least one test failed
+for ENGINE in switch threaded register jit; do
+    for FILE in ../test/*.java; do
+        echo "Running test $FILE (engine $ENGINE)"
+        ./src/interpreter $FILE --engine=$ENGINE > $FILE.result
+        # replace .java extension with .out extension
+        OUTFILE=${FILE/.java/.out}
+        diff $FILE.result $OUTFILE
+        if [ $? -eq 0 ]; then
+            echo "Test $FILE passed"
+        else
+            echo "Test $FILE failed"
+        fi
+    done
+done
+
+# 3. Run the tests from their images
+for FILE in ../test/*.java; do
+    echo "Running test $FILE (image)"
+    ./src/interpreter $FILE --emit-image $FILE.mvm
+    ./src/interpreter $FILE.mvm > $FILE.result
+    OUTFILE=${FILE/.java/.out}
+    diff $FILE.result $OUTFILE
+    if [ $? -eq 0 ]; then
+        echo "Test $FILE passed"
+    else
+        echo "Test $FILE failed"
+    fi
+done
+
+# 4. Run the tests compiled ahead of time to C
+make aot
 for FILE in ../test/*.java; do
-    echo "Running test $FILE"
-    ./src/interpreter $FILE > $FILE.result
-    # replace .java extension with .out extension
+    echo "Running test $FILE (aot)"
+    NAME=$(basename $FILE .java)
+    ./src/aot_$NAME > $FILE.result
     OUTFILE=${FILE/.java/.out}
     diff $FILE.result $OUTFILE
     if [ $? -eq 0 ]; then
@@ -19,4 +50,4 @@ for FILE in ../test/*.java; do
     else
         echo "Test $FILE failed"
     fi
-done
\ No newline at end of file
+done
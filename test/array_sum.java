@@ -0,0 +1,54 @@
+class ArraySum {
+    public static void main(String[] a) {
+        System.out.println(new Sum().Start(10));
+    }
+}
+
+class Sum {
+    int[] squares;
+
+    public int Start(int n) {
+        int[] numbers;
+        int i;
+        int len;
+        int total;
+        numbers = new int[n];
+        i = 0;
+        while (i < numbers.length) {
+            numbers[i] = i + 1;
+            i = i + 1;
+        }
+        squares = new int[n];
+        i = 0;
+        len = squares.length;
+        while (i < len) {
+            squares[i] = numbers[i] * numbers[i];
+            i = i + 1;
+        }
+        total = this.Total(numbers);
+        System.out.println(total);
+        total = this.Total(squares);
+        System.out.println(total);
+        i = 0;
+        while (i < n) {
+            System.out.println(squares[i]);
+            i = i + 1;
+        }
+        return squares[n - 1];
+    }
+
+    public int Total(int[] values) {
+        int i;
+        int total;
+        i = 0;
+        total = 0;
+        while (i < values.length) {
+            if (0 < values[i])
+                total = total + values[i];
+            else
+                total = total - 1;
+            i = i + 1;
+        }
+        return total;
+    }
+}
@@ -0,0 +1,48 @@
+class Conditions {
+    public static void main(String[] a) {
+        System.out.println(new Cond().Start(5, true));
+    }
+}
+
+class Cond {
+    boolean flag;
+
+    public int Start(int n, boolean up) {
+        int i;
+        int count;
+        boolean done;
+        i = 0;
+        count = 0;
+        done = false;
+        while (!done) {
+            if (!(i < n))
+                done = true;
+            else
+                count = count + 1;
+            i = i + 1;
+        }
+        System.out.println(count);
+        if (up)
+            System.out.println(1);
+        else
+            System.out.println(0);
+        if (!up)
+            System.out.println(1);
+        else
+            System.out.println(0);
+        flag = up;
+        if (flag)
+            System.out.println(2);
+        else
+            System.out.println(3);
+        if (!((n < i)))
+            System.out.println(4);
+        else
+            System.out.println(5);
+        if ((i < n) && up)
+            System.out.println(6);
+        else
+            System.out.println(7);
+        return i;
+    }
+}
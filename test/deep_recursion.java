@@ -0,0 +1,16 @@
+class DeepRecursion {
+    public static void main(String[] a) {
+        System.out.println(new R().Down(200000));
+    }
+}
+
+class R {
+    public int Down(int n) {
+        int r;
+        if (n < 1)
+            r = 0;
+        else
+            r = 1 + (this.Down(n - 1));
+        return r;
+    }
+}
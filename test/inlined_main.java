@@ -0,0 +1,22 @@
+class InlinedMain {
+    public static void main(String[] a) {
+        // the calls are inlined into main, whose frame holds their locals
+        System.out.println(new A().Id(5) + new A().Id(7));
+        // each array takes 48MB, the third one is only allocated after a collection
+        System.out.println(new A().Run(6000000));
+        System.out.println(new A().Run(6000000));
+        System.out.println(new A().Run(6000000));
+    }
+}
+
+class A {
+    public int Id(int x) {
+        return x;
+    }
+
+    public int Run(int n) {
+        int[] x;
+        x = new int[n];
+        return x.length;
+    }
+}
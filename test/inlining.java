@@ -0,0 +1,94 @@
+class Inlining {
+    public static void main(String[] a) {
+        System.out.println(new Test().Start());
+    }
+}
+
+class Test {
+    public int Start() {
+        Shape s;
+        Square q;
+        Cube c;
+        int i;
+        int total;
+        s = new Shape();
+        q = new Square();
+        c = new Cube();
+        total = 0;
+        i = 0;
+        while (i < 3) {
+            total = total + s.Size(i) + q.Size(i) + c.Size(i);
+            total = total + this.Abs(0 - i) + this.Count(i);
+            i = i + 1;
+        }
+        System.out.println(total);
+        System.out.println(this.NameOf(c));
+        System.out.println(this.Describe(s));
+        System.out.println(this.Describe(q));
+        System.out.println(this.Describe(c));
+        return this.Resize(q);
+    }
+
+    public int Describe(Shape s) {
+        return s.Size(2);
+    }
+
+    public int NameOf(Shape s) {
+        return s.Name();
+    }
+
+    public int Resize(Shape s) {
+        return s.SetSide(7) + s.Side();
+    }
+
+    public int Abs(int x) {
+        int r;
+        if (x < 0)
+            r = 0 - x;
+        else
+            r = x;
+        return r;
+    }
+
+    // its local starts at 0 on every call
+    public int Count(int n) {
+        int k;
+        while (k < n) {
+            k = k + 1;
+        }
+        return k;
+    }
+}
+
+class Shape {
+    int side;
+
+    public int Size(int x) {
+        return 1;
+    }
+
+    public int Name() {
+        return 100;
+    }
+
+    public int SetSide(int x) {
+        side = x;
+        return side;
+    }
+
+    public int Side() {
+        return side;
+    }
+}
+
+class Square extends Shape {
+    public int Size(int x) {
+        return x * x;
+    }
+}
+
+class Cube extends Square {
+    public int Size(int x) {
+        return x * x * x;
+    }
+}
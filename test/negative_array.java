@@ -0,0 +1,26 @@
+class NegativeArray {
+    public static void main(String[] a) {
+        System.out.println(new Arrays().Start(8));
+    }
+}
+
+class Arrays {
+    public int Start(int n) {
+        int[] x;
+        int[] victim;
+        int i;
+        x = new int[0];
+        System.out.println(x.length);
+        victim = new int[4];
+        // exits with a NegativeArraySizeException, the writes below would
+        // otherwise land in victim
+        x = new int[0 - 1];
+        victim = new int[4];
+        i = 0;
+        while (i < n) {
+            x[i] = 777;
+            i = i + 1;
+        }
+        return victim[0];
+    }
+}
@@ -0,0 +1,54 @@
+class PolymorphicCall {
+    public static void main(String[] a) {
+        System.out.println(new Runner().Run());
+    }
+}
+
+class Runner {
+    public int Run() {
+        int i;
+        int s;
+        A x;
+        B y;
+        C z;
+        D w;
+        E v;
+        i = 0;
+        s = 0;
+        x = new A();
+        y = new B();
+        z = new C();
+        w = new D();
+        v = new E();
+        while (i < 1000) {
+            s = s + this.Use(x) + this.Use(y) + this.Use(z) + this.Use(w) + this.Use(v);
+            i = i + 1;
+        }
+        return s;
+    }
+
+    public int Use(A a) {
+        return a.Get();
+    }
+}
+
+class A {
+    public int Get() { return 1; }
+    public int Call() { return this.Get(); }
+}
+
+class B extends A {
+    public int Get() { return 2; }
+}
+
+class C extends A {
+    public int Get() { return 3; }
+}
+
+class D extends A {
+    public int Get() { return 4; }
+}
+
+class E extends A {
+    public int Get() { return 5; }
+}
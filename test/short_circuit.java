@@ -0,0 +1,50 @@
+class ShortCircuit {
+    public static void main(String[] a) {
+        System.out.println(new Test().Start());
+    }
+}
+
+class Test {
+    int calls;
+
+    public boolean Check(boolean result) {
+        calls = calls + 1;
+        System.out.println(calls);
+        return result;
+    }
+
+    public int Start() {
+        boolean b;
+        int[] numbers;
+        int i;
+        calls = 0;
+        if (this.Check(false) && this.Check(true))
+            System.out.println(10);
+        else
+            System.out.println(11);
+        if (this.Check(true) && this.Check(true))
+            System.out.println(12);
+        else
+            System.out.println(13);
+        b = this.Check(false) && this.Check(false);
+        if (!b)
+            System.out.println(14);
+        else
+            System.out.println(15);
+        if (!(this.Check(true) && this.Check(false)))
+            System.out.println(16);
+        else
+            System.out.println(17);
+        numbers = new int[3];
+        i = 0;
+        // the index is only used when it is in bounds
+        while ((i < numbers.length) && (numbers[i] < 1)) {
+            numbers[i] = i + 1;
+            i = i + 1;
+        }
+        while ((i < numbers.length) && this.Check(true) && (numbers[i] < 100)) {
+            i = i + 1;
+        }
+        return i;
+    }
+}